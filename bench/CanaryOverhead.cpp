@@ -0,0 +1,60 @@
+#include <Malloc.hpp>
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+/**
+ * What sampled canaries cost: the same churn of small allocations through a
+ * store without canaries and one tagging one allocation in a thousand.
+ *
+ * Usage: CanaryOverhead [rounds]
+ */
+
+template <typename Canaries>
+using Store = ArenaStore<PowerOfTwoSizeClasses, MutexLock, DefaultPages, NoStats, DefaultThreadCaches, Canaries>;
+
+template <typename Canaries> double run(const char* name, size_t rounds) {
+    Store<Canaries> store;
+    std::vector<void*> ptrs(4096, nullptr);
+    uint64_t random = 0x2545f4914f6cdd1d;
+
+    uint64_t start = monotonicNanos();
+
+    for (size_t i = 0; i < rounds; i++) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+
+        void*& ptr = ptrs[random % ptrs.size()];
+        store.free(ptr);
+        ptr = store.alloc(random >> 32 & 511);
+    }
+
+    double nanos = double(monotonicNanos() - start) / rounds;
+
+    for (void* ptr : ptrs) {
+        store.free(ptr);
+    }
+
+    std::cout << name << ": " << nanos << "ns per free and alloc\n";
+
+    return nanos;
+}
+
+int main(int argc, char** argv) {
+    size_t rounds = argc > 1 ? std::stoul(argv[1]) : 5'000'000;
+
+    // Alternate the two and keep the best of each, which is what's left once
+    // the noise of a shared machine is taken out.
+    double plain = 1e9;
+    double sampled = 1e9;
+
+    for (size_t i = 0; i < 5; i++) {
+        plain = std::min(plain, run<NoCanaries>("no canaries", rounds));
+        sampled = std::min(sampled, run<SampledCanaries<>>("sampled canaries", rounds));
+    }
+
+    std::cout << "overhead: " << (sampled / plain - 1) * 100 << "%\n";
+
+    return 0;
+}
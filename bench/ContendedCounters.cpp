@@ -0,0 +1,102 @@
+#include <Malloc.hpp>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+/**
+ * Contended counter workload: every worker allocates a small counter of its
+ * own, all at about the same time, then hammers it. The stores have no thread
+ * caches, which would hand each thread slots from a batch of its own, so the
+ * counters come out of one arena next to each other in whatever order the
+ * workers got there. With packed slots they share cache lines and the workers
+ * fight over them; with the counter class isolated each one has a line to
+ * itself.
+ *
+ * Usage: ContendedCounters [threads] [increments per thread]
+ */
+
+struct Counter {
+    std::atomic<uint64_t> value;
+    uint64_t padding;
+};
+
+using PackedStore = ArenaStore<PowerOfTwoSizeClasses, MutexLock, DefaultPages, NoStats, NoThreadCache>;
+
+// Class 1 holds 16-byte objects like Counter.
+using IsolatedStore = ArenaStore<
+    CacheLineIsolated<PowerOfTwoSizeClasses, 0b10>, MutexLock, DefaultPages, NoStats, NoThreadCache
+>;
+
+template <typename Store> double run(const char* name, size_t threads, uint64_t increments) {
+    Store store;
+    std::vector<Counter*> counters(threads);
+    std::atomic<size_t> allocated = 0;
+    std::atomic<uint64_t> start = 0;
+    std::vector<std::thread> workers;
+
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back([&, i] {
+            Counter* counter = static_cast<Counter*>(store.alloc(sizeof(Counter)));
+            counter->value.store(0);
+            counters[i] = counter;
+
+            // Nobody starts counting until every counter is allocated, so the
+            // allocations interleave and the timing covers only the counting.
+            if (allocated.fetch_add(1) + 1 == threads) {
+                start.store(monotonicNanos());
+            }
+
+            while (allocated.load() < threads) {
+                std::this_thread::yield();
+            }
+
+            for (uint64_t n = 0; n < increments; n++) {
+                counter->value.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    double seconds = (monotonicNanos() - start.load()) / 1e9;
+    uint64_t total = 0;
+
+    for (Counter* counter : counters) {
+        total += counter->value.load();
+    }
+
+    auto [lowest, highest] = std::minmax_element(counters.begin(), counters.end());
+    size_t span = reinterpret_cast<char*>(*highest) - reinterpret_cast<char*>(*lowest);
+
+    for (Counter* counter : counters) {
+        store.free(counter);
+    }
+
+    double rate = total / seconds / 1e6;
+
+    std::cout << name << ": " << threads << " threads, counters within " << span
+        << " bytes of each other, " << rate << "M increments/s\n";
+
+    return rate;
+}
+
+int main(int argc, char** argv) {
+    size_t hardware = std::thread::hardware_concurrency();
+    size_t threads = argc > 1 ? std::stoul(argv[1]) : (hardware > 1 ? hardware : 2);
+    uint64_t increments = argc > 2 ? std::stoull(argv[2]) : 20'000'000;
+
+    double packed = run<PackedStore>("packed", threads, increments);
+    double isolated = run<IsolatedStore>("isolated", threads, increments);
+
+    std::cout << "speedup: " << isolated / packed << "x\n";
+
+    if (hardware < 2) {
+        std::cout << "(only one CPU; there is nothing to contend with)\n";
+    }
+
+    return 0;
+}
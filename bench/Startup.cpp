@@ -0,0 +1,147 @@
+#include <Malloc.hpp>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Startup latency: the time from exec to the end of the first 10k
+ * allocations, as a short-lived tool would see it, with and without a warm
+ * pool. Each run re-executes this binary, and the child reports back how long
+ * it took to reach main(), to fill the pool and to make the allocations after
+ * that, and how many page faults it took in all. The pool doesn't make the
+ * work go away; it moves it out of the allocations, to wherever warm() runs.
+ *
+ * Usage: Startup [runs]
+ */
+
+constexpr size_t numAllocations = 10'000;
+
+// Arenas per size class in the warm pool.
+constexpr size_t warmArenas = 16;
+
+struct Sample {
+    uint64_t toMain;
+    uint64_t warming;
+    uint64_t allocating;
+    uint64_t nanos;
+    uint64_t faults;
+};
+
+int child(bool warm, uint64_t execNanos) {
+    uint64_t start = monotonicNanos();
+
+    if (warm) {
+        myMallocWarm(warmArenas);
+    }
+
+    uint64_t warmed = monotonicNanos();
+
+    static void* ptrs[numAllocations];
+    uint64_t random = 0x2545f4914f6cdd1d;
+
+    // A spread of sizes like a tool parsing its input would ask for, mostly
+    // small.
+    for (size_t i = 0; i < numAllocations; i++) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+
+        ptrs[i] = myMalloc(8 << (random % 64 < 48 ? random % 4 : random % 9));
+    }
+
+    uint64_t end = monotonicNanos();
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%lu %lu %lu %ld\n", start - execNanos, warmed - execNanos, end - execNanos, usage.ru_minflt);
+
+    return 0;
+}
+
+Sample spawn(bool warm) {
+    int fds[2];
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    uint64_t start = monotonicNanos();
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        std::string startArg = std::to_string(start);
+        execl("/proc/self/exe", "Startup", warm ? "--warm" : "--cold", startArg.c_str(), nullptr);
+        _exit(127);
+    }
+
+    close(fds[1]);
+
+    char line[64] = {};
+    ssize_t length = read(fds[0], line, sizeof(line) - 1);
+    close(fds[0]);
+    waitpid(pid, nullptr, 0);
+
+    Sample sample = {};
+    uint64_t warmed;
+
+    if (length <= 0
+        || sscanf(line, "%lu %lu %lu %lu", &sample.toMain, &warmed, &sample.nanos, &sample.faults) != 4) {
+        std::cerr << "child failed\n";
+        exit(1);
+    }
+
+    sample.warming = warmed - sample.toMain;
+    sample.allocating = sample.nanos - warmed;
+
+    return sample;
+}
+
+void report(const char* name, std::vector<Sample>& samples) {
+    auto byTime = [](const Sample& a, const Sample& b) { return a.nanos < b.nanos; };
+    std::sort(samples.begin(), samples.end(), byTime);
+
+    const Sample& median = samples[samples.size() / 2];
+
+    std::vector<uint64_t> allocating;
+
+    for (const Sample& sample : samples) {
+        allocating.push_back(sample.allocating);
+    }
+
+    std::sort(allocating.begin(), allocating.end());
+
+    std::cout << name << ": median " << median.nanos / 1000 << "us (" << median.toMain / 1000
+        << "us to main, " << median.warming / 1000 << "us warming), best " << samples.front().nanos / 1000
+        << "us, " << median.faults << " minor faults; allocations alone median "
+        << allocating[allocating.size() / 2] / 1000 << "us\n";
+}
+
+int main(int argc, char** argv) {
+    if (argc == 3 && (std::string(argv[1]) == "--warm" || std::string(argv[1]) == "--cold")) {
+        return child(std::string(argv[1]) == "--warm", std::stoull(argv[2]));
+    }
+
+    size_t runs = argc > 1 ? std::stoul(argv[1]) : 30;
+    std::vector<Sample> cold;
+    std::vector<Sample> warm;
+
+    for (size_t i = 0; i < runs; i++) {
+        cold.push_back(spawn(false));
+        warm.push_back(spawn(true));
+    }
+
+    std::cout << "exec to " << numAllocations << " allocations, " << runs << " runs\n";
+    report("cold", cold);
+    report("warm pool", warm);
+
+    return 0;
+}
@@ -0,0 +1,155 @@
+#include <SharedArena.hpp>
+#include <LatencyStats.hpp>
+#include <stdio.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Restart time of a cache of small objects kept in a file-backed SharedArena:
+ * rebuilding every object from scratch, as a cache in anonymous memory has to,
+ * against remapping a checkpointed file and remapping one left without a
+ * checkpoint, which has to be recovered first. Each restart is timed until
+ * the cache is ready, and again after a walk over every object, as the first
+ * lookups would do. The file stays in the page cache between runs, so this is
+ * a warm restart, not one after a reboot.
+ *
+ * Usage: WarmRestart [objects] [runs]
+ */
+
+const char* path = "/tmp/malloc-arena-warm-restart";
+
+struct Entry {
+    uint64_t next;
+    uint64_t key;
+    uint64_t value[2];
+};
+
+struct Sample {
+    uint64_t ready;
+    uint64_t walked;
+};
+
+size_t regionSize(size_t objects) {
+    return (objects * sizeof(Entry) / 4096 + 1024) * 4096;
+}
+
+uint64_t build(SharedArena<>* arena, size_t objects) {
+    uint64_t head = 0;
+
+    for (size_t i = 0; i < objects; i++) {
+        auto* entry = static_cast<Entry*>(arena->alloc(sizeof(Entry)));
+        *entry = Entry{head, i, {i * 3, i * 7}};
+        head = arena->offsetOf(entry);
+    }
+
+    arena->setRoot(head);
+
+    return head;
+}
+
+template <typename Mark> void walk(SharedArena<>* arena, Mark mark) {
+    for (uint64_t offset = arena->root(); offset != 0; ) {
+        auto* entry = static_cast<Entry*>(arena->at(offset));
+        mark(entry, sizeof(Entry));
+        offset = entry->next;
+    }
+}
+
+uint64_t checksum(SharedArena<>* arena) {
+    uint64_t sum = 0;
+
+    walk(arena, [&](const void* ptr, size_t bytes) {
+        sum += static_cast<const Entry*>(ptr)->value[1];
+    });
+
+    return sum;
+}
+
+/**
+ * Leaves the file holding `objects` entries, checkpointed or not.
+ */
+void prepare(size_t objects, bool checkpoint) {
+    remove(path);
+
+    SharedRegion region = SharedRegion::file(path, regionSize(objects));
+    auto* arena = SharedArena<>::create(region.base(), region.size());
+    build(arena, objects);
+
+    if (checkpoint) {
+        arena->checkpoint();
+    }
+}
+
+Sample rebuild(size_t objects) {
+    remove(path);
+
+    uint64_t start = monotonicNanos();
+    SharedRegion region = SharedRegion::file(path, regionSize(objects));
+    auto* arena = SharedArena<>::create(region.base(), region.size());
+    build(arena, objects);
+    uint64_t ready = monotonicNanos();
+    volatile uint64_t sum = checksum(arena);
+
+    return Sample{ready - start, monotonicNanos() - start};
+}
+
+Sample restart() {
+    uint64_t start = monotonicNanos();
+    SharedRegion region = SharedRegion::file(path, 0);
+    auto* arena = SharedArena<>::restore(region.base(), region.size());
+
+    if (arena == nullptr) {
+        std::cerr << "restore failed\n";
+        exit(1);
+    }
+
+    if (arena->needsRecovery() && !arena->recover([&](auto mark) { walk(arena, mark); })) {
+        std::cerr << "recovery failed\n";
+        exit(1);
+    }
+
+    uint64_t ready = monotonicNanos();
+    volatile uint64_t sum = checksum(arena);
+
+    return Sample{ready - start, monotonicNanos() - start};
+}
+
+void report(const char* name, std::vector<Sample>& samples) {
+    auto byReady = [](const Sample& a, const Sample& b) { return a.ready < b.ready; };
+    std::sort(samples.begin(), samples.end(), byReady);
+
+    const Sample& median = samples[samples.size() / 2];
+
+    std::cout << name << ": median " << median.ready / 1000 << "us to ready, "
+        << median.walked / 1000 << "us after a full walk\n";
+}
+
+int main(int argc, char** argv) {
+    size_t objects = argc > 1 ? std::stoul(argv[1]) : 1'000'000;
+    size_t runs = argc > 2 ? std::stoul(argv[2]) : 5;
+
+    std::vector<Sample> rebuilt;
+    std::vector<Sample> restored;
+    std::vector<Sample> recovered;
+
+    for (size_t i = 0; i < runs; i++) {
+        rebuilt.push_back(rebuild(objects));
+
+        prepare(objects, true);
+        restored.push_back(restart());
+
+        prepare(objects, false);
+        recovered.push_back(restart());
+    }
+
+    remove(path);
+
+    std::cout << objects << " objects of " << sizeof(Entry) << " bytes, " << runs << " runs\n";
+    report("rebuild", rebuilt);
+    report("restore checkpoint", restored);
+    report("recover unclean", recovered);
+
+    return 0;
+}
@@ -0,0 +1,532 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define ALIGNMENT 8
+#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
+
+// You can assume this as your page size. On some OSs (e.g. macOS),
+// it may in fact be larger and you'll waste memory due to internal
+// fragmentation as a result, but that's okay for this exercise.
+constexpr size_t pageSize = 4096;
+
+// The largest alignment every tier hands out natively: arena slots whose size
+// is a multiple of it, and every medium item and BigAlloc.
+constexpr size_t maxAlignment = 128;
+
+/**
+ * Policies that configure ArenaStore at compile time. Each policy is a plain
+ * class whose members are resolved statically, so anything a build doesn't use
+ * (locks in a single-threaded build, counters in a stats-free build) compiles
+ * away entirely.
+ *
+ * ArenaStore<SizeClassPolicy, LockPolicy, PagePolicy, StatsPolicy, CachePolicy, CanaryPolicy>
+ *
+ * Canary policies live in Canaries.hpp.
+ */
+
+/**
+ * Size class policy: power-of-two classes from MinSize up to
+ * MinSize << (NumClasses - 1). The default matches the original store:
+ * 0: 8 bytes, 1: 16 bytes, ... 8: 2048 bytes.
+ *
+ * A SizeClassPolicy must provide numClasses, maxSize, sizeOf(cls) and
+ * classOf(bytes), all usable in constant expressions.
+ */
+template <size_t MinSize, size_t NumClasses> struct PowerOfTwoClasses {
+    static_assert(MinSize >= ALIGNMENT && (MinSize & (MinSize - 1)) == 0,
+        "MinSize must be a power of two of at least ALIGNMENT");
+    static_assert(NumClasses > 0 && NumClasses <= 16, "Unreasonable number of classes");
+
+    static constexpr size_t numClasses = NumClasses;
+    static constexpr size_t minSize = MinSize;
+    static constexpr size_t maxSize = MinSize << (NumClasses - 1);
+
+    /**
+     * The slot size of the given class.
+     */
+    static constexpr size_t sizeOf(size_t cls) {
+        return MinSize << cls;
+    }
+
+    /**
+     * The smallest class whose slots can hold `bytes`. Callers must not pass
+     * more than maxSize.
+     */
+    static constexpr size_t classOf(size_t bytes) {
+        return s_lookup.classes[(bytes + ALIGNMENT - 1) / ALIGNMENT];
+    }
+
+private:
+    // One entry per ALIGNMENT-sized step up to maxSize, so classOf is a single
+    // load from a table the compiler can fold for constant arguments.
+    struct Lookup {
+        uint8_t classes[maxSize / ALIGNMENT + 1];
+    };
+
+    static constexpr Lookup makeLookup() {
+        Lookup lookup = {};
+        size_t cls = 0;
+
+        for (size_t i = 0; i <= maxSize / ALIGNMENT; i++) {
+            while (sizeOf(cls) < i * ALIGNMENT) {
+                cls++;
+            }
+
+            lookup.classes[i] = static_cast<uint8_t>(cls);
+        }
+
+        return lookup;
+    }
+
+    static constexpr Lookup s_lookup = makeLookup();
+};
+
+using PowerOfTwoSizeClasses = PowerOfTwoClasses<8, 9>;
+
+/**
+ * Wraps another size class policy and rounds the slots of every class whose
+ * bit is set in IsolatedMask up to a multiple of LineSize. Arenas align slots
+ * to their size, so each such slot starts on a line of its own and two hot
+ * objects, like per-thread counters allocated back to back, never share one.
+ * It costs memory: an isolated 16-byte class only fits a quarter as many
+ * slots per arena.
+ *
+ * CacheLineIsolated<PowerOfTwoSizeClasses, 0b0110> isolates 16 and 32 bytes.
+ */
+template <typename Classes, uint32_t IsolatedMask, size_t LineSize = 64>
+struct CacheLineIsolated : Classes {
+    static_assert(LineSize >= ALIGNMENT && LineSize <= maxAlignment && (LineSize & (LineSize - 1)) == 0,
+        "LineSize must be a power of two arenas can align to");
+    static_assert((IsolatedMask >> Classes::numClasses) == 0, "IsolatedMask names a class that doesn't exist");
+
+    static constexpr bool isolated(size_t cls) {
+        return IsolatedMask >> cls & 1;
+    }
+
+    static constexpr size_t sizeOf(size_t cls) {
+        size_t size = Classes::sizeOf(cls);
+
+        return isolated(cls) ? (size + LineSize - 1) & ~(LineSize - 1) : size;
+    }
+
+    static constexpr size_t maxSize = sizeOf(Classes::numClasses - 1);
+};
+
+/**
+ * The smallest slot of any class. Not necessarily class 0's: CacheLineIsolated
+ * can round the first classes up past later ones.
+ */
+template <typename Classes> constexpr size_t smallestSlot() {
+    size_t smallest = Classes::sizeOf(0);
+
+    for (size_t cls = 1; cls < Classes::numClasses; cls++) {
+        smallest = Classes::sizeOf(cls) < smallest ? Classes::sizeOf(cls) : smallest;
+    }
+
+    return smallest;
+}
+
+/**
+ * Size classes of the medium tier, which sits between the arenas and
+ * BigAlloc. Every class is a whole number of pages: one class per page count
+ * up to 8 pages, then four per doubling up to 64 pages (256 KiB), so rounding
+ * up never wastes more than a quarter of an item past the first 32 KiB.
+ */
+struct MediumSizeClasses {
+    static constexpr size_t numClasses = 20;
+    static constexpr size_t maxPages = 64;
+    static constexpr size_t maxSize = maxPages * pageSize;
+
+    /**
+     * The number of pages in an item of the given class.
+     */
+    static constexpr size_t pagesOf(size_t cls) {
+        if (cls < 8) {
+            return cls + 1;
+        }
+
+        return (size_t(8) << (cls - 8) / 4) * (5 + (cls - 8) % 4) / 4;
+    }
+
+    static constexpr size_t sizeOf(size_t cls) {
+        return pagesOf(cls) * pageSize;
+    }
+
+    /**
+     * The smallest class whose items can hold `bytes`, which must be between 1
+     * and maxSize.
+     */
+    static constexpr size_t classOf(size_t bytes) {
+        size_t pages = (bytes + pageSize - 1) / pageSize;
+
+        if (pages <= 8) {
+            return pages - 1;
+        }
+
+        // Past 8 pages, each run of four classes spans a power of two.
+        size_t top = 63 - __builtin_clzll(pages - 1);
+
+        return 8 + (top - 3) * 4 + ((pages - 1) >> (top - 2)) - 4;
+    }
+};
+
+/**
+ * Lock policies. Anything satisfying Lockable works; ArenaStore keeps one per
+ * size class. try_lock is used on paths that must never block, such as
+ * trimming the central free lists while flushing a thread cache.
+ */
+class MutexLock {
+    std::mutex m_mutex;
+
+public:
+    constexpr MutexLock() = default;
+
+    void lock() { m_mutex.lock(); }
+    bool try_lock() { return m_mutex.try_lock(); }
+    void unlock() { m_mutex.unlock(); }
+};
+
+class SpinLock {
+    std::atomic<bool> m_locked{false};
+
+public:
+    constexpr SpinLock() = default;
+
+    void lock() {
+        while (m_locked.exchange(true, std::memory_order_acquire)) {
+            while (m_locked.load(std::memory_order_relaxed)) { }
+        }
+    }
+
+    bool try_lock() {
+        return !m_locked.load(std::memory_order_relaxed)
+            && !m_locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock() { m_locked.store(false, std::memory_order_release); }
+};
+
+/**
+ * For single-threaded uses. lock() and unlock() inline to nothing.
+ */
+class NoLock {
+public:
+    constexpr NoLock() = default;
+
+    void lock() { }
+    bool try_lock() { return true; }
+    void unlock() { }
+};
+
+/**
+ * Whether a lock policy keeps other threads out. A store whose locks don't is
+ * owned by one thread, and nothing else may touch it, not even the memory
+ * pressure hooks. Specialize this for other locks that do nothing.
+ */
+template <typename Lock> struct ExcludesThreads : std::true_type { };
+template <> struct ExcludesThreads<NoLock> : std::false_type { };
+
+/**
+ * Process-wide counts of the syscalls page policies make. Cheap next to the
+ * syscalls themselves, so always on.
+ */
+struct PageSyscalls {
+    inline static std::atomic<size_t> mmaps{0};
+    inline static std::atomic<size_t> munmaps{0};
+    inline static std::atomic<size_t> mprotects{0};
+    inline static std::atomic<size_t> madvises{0};
+
+    struct Snapshot {
+        size_t mmaps;
+        size_t munmaps;
+        size_t mprotects;
+        size_t madvises;
+    };
+
+    static void count(std::atomic<size_t>& counter) {
+        counter.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static Snapshot snapshot() {
+        return Snapshot {
+            mmaps.load(std::memory_order_relaxed),
+            munmaps.load(std::memory_order_relaxed),
+            mprotects.load(std::memory_order_relaxed),
+            madvises.load(std::memory_order_relaxed),
+        };
+    }
+
+    /**
+     * Faults in a page-aligned read/write region in one go, rather than a page
+     * at a time as it is first touched. Kernels without MADV_POPULATE_WRITE
+     * get each page written to, so the region must not be in use yet.
+     */
+    static void prefault(void* addr, size_t bytes) {
+#ifdef MADV_POPULATE_WRITE
+        count(madvises);
+
+        if (madvise(addr, bytes, MADV_POPULATE_WRITE) == 0) {
+            return;
+        }
+#endif
+
+        for (size_t offset = 0; offset < bytes; offset += 4096) {
+            volatile char* byte = static_cast<char*>(addr) + offset;
+            *byte = *byte;
+        }
+    }
+};
+
+/**
+ * Page policy: anonymous mmap'd regions aligned to PageSize. Every region
+ * handed out by map() starts on a PageSize boundary, which is what lets free()
+ * find an allocation's MMapObject header by rounding down.
+ *
+ * With Populate, every region is mapped with MAP_POPULATE, so its pages are
+ * faulted in by the mmap itself instead of one by one on first touch.
+ *
+ * Callers must not assume map() returns zeroed memory; other page policies
+ * recycle regions.
+ */
+template <size_t PageSize, bool Populate = false> struct AnonymousPages {
+    static_assert(PageSize >= 4096 && (PageSize & (PageSize - 1)) == 0,
+        "PageSize must be a power of two multiple of the OS page");
+
+    static constexpr size_t pageSize = PageSize;
+
+    static constexpr size_t roundUp(size_t bytes) {
+        return (bytes + PageSize - 1) & ~(PageSize - 1);
+    }
+
+    /**
+     * Maps at least `bytes` bytes. Returns nullptr on failure.
+     */
+    static void* map(size_t bytes) {
+        size_t size = roundUp(bytes);
+        size_t slack = PageSize > osPageSize() ? PageSize - osPageSize() : 0;
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | (Populate ? MAP_POPULATE : 0);
+
+        char* region = static_cast<char*>(
+            mmap(nullptr, size + slack, PROT_READ | PROT_WRITE, flags, -1, 0)
+        );
+        PageSyscalls::count(PageSyscalls::mmaps);
+
+        if (region == MAP_FAILED) {
+            return nullptr;
+        }
+
+        if (slack == 0) {
+            return region;
+        }
+
+        // mmap only guarantees OS page alignment, so trim the over-allocation
+        // down to a PageSize-aligned window.
+        char* aligned = reinterpret_cast<char*>(roundUp(reinterpret_cast<uintptr_t>(region)));
+        size_t head = aligned - region;
+
+        if (head > 0) {
+            munmap(region, head);
+            PageSyscalls::count(PageSyscalls::munmaps);
+        }
+
+        if (slack - head > 0) {
+            munmap(aligned + size, slack - head);
+            PageSyscalls::count(PageSyscalls::munmaps);
+        }
+
+        return aligned;
+    }
+
+    /**
+     * Unmaps a region previously returned by map(bytes).
+     */
+    static void unmap(void* addr, size_t bytes) {
+        munmap(addr, roundUp(bytes));
+        PageSyscalls::count(PageSyscalls::munmaps);
+    }
+
+    /**
+     * Nothing to keep warm: every map() is a fresh mapping. Use Populate to
+     * have those faulted in.
+     */
+    static void prewarm(size_t bytes) { }
+
+    /**
+     * Nothing to do around fork() or thread exit; the kernel does the work.
+     */
+    static void registerLifecycle() { }
+
+private:
+    static size_t osPageSize() {
+        static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return size;
+    }
+};
+
+using MMapPages = AnonymousPages<pageSize>;
+
+// MMapPages, prefaulted.
+using PopulatedPages = AnonymousPages<pageSize, true>;
+
+/**
+ * Cache policies. With ThreadCaches, each thread keeps a small stack of free
+ * slots per size class and exchanges them in batches with a lock-free central
+ * free list, so the per-class lock is only taken when the central list runs
+ * dry or grows too long. Up to MaxThreads threads get a cache; any beyond that
+ * fall back to the locked path.
+ */
+template <size_t MaxThreads> struct ThreadCaches {
+    static constexpr bool enabled = true;
+    static constexpr size_t maxThreads = MaxThreads;
+
+    // Batches a class may park on its central list before a flush hands the
+    // excess back to the arenas.
+    static constexpr size_t centralBatches = 8;
+};
+
+/**
+ * Every alloc and free goes straight to the arenas under the class lock.
+ */
+struct NoThreadCache {
+    static constexpr bool enabled = false;
+    static constexpr size_t maxThreads = 0;
+    static constexpr size_t centralBatches = 0;
+};
+
+using DefaultThreadCaches = ThreadCaches<256>;
+
+/**
+ * The slow paths ArenaStore reports to its StatsPolicy. Anything not listed is
+ * a fast path: an alloc or free served by the thread cache alone.
+ */
+enum class SlowPath {
+    // An empty thread cache refilling from the central list or the arenas.
+    Refill,
+    // A full thread cache moving a batch to the central list.
+    Flush,
+    // The part of a Refill or Flush that fell back to the arenas under the
+    // class lock: the central list was empty, or no batch could be had.
+    LockedRefill,
+    LockedFlush,
+    // An alloc or free that went to the arenas under the class lock because
+    // the thread has no cache.
+    LockedAlloc,
+    LockedFree,
+    // Mapping a new arena.
+    ArenaCreate,
+    BigAlloc,
+    BigFree,
+    // An alloc or free in the medium tier, under its lock.
+    MediumAlloc,
+    MediumFree,
+    Count
+};
+
+constexpr size_t numSlowPaths = static_cast<size_t>(SlowPath::Count);
+
+/**
+ * Stats policies. ArenaStore derives from its StatsPolicy, so an empty policy
+ * takes no space and its hooks inline away.
+ *
+ * When a policy sets `timed`, the store measures each slow path and each
+ * contended class lock acquisition and passes the duration in nanoseconds;
+ * otherwise the durations are 0 and no clock is read.
+ */
+class NoStats {
+public:
+    static constexpr bool timed = false;
+
+    void onAlloc(size_t cls) { }
+    void onFree(size_t cls) { }
+    void onBigAlloc(size_t bytes) { }
+    void onBigFree(size_t bytes) { }
+    void onArenaCreate(size_t cls) { }
+    void onArenaRelease(size_t cls) { }
+    void onSlowPath(SlowPath path, uint64_t nanos) { }
+    void onLockWait(size_t cls, uint64_t nanos) { }
+};
+
+class CountingStats {
+    std::atomic<size_t> m_allocs{0};
+    std::atomic<size_t> m_frees{0};
+    std::atomic<size_t> m_bigAllocs{0};
+    std::atomic<size_t> m_bigFrees{0};
+    std::atomic<size_t> m_bigBytes{0};
+    std::atomic<size_t> m_arenasCreated{0};
+    std::atomic<size_t> m_arenasReleased{0};
+    std::atomic<size_t> m_slowPaths[numSlowPaths] = {};
+    std::atomic<size_t> m_lockWaits{0};
+
+public:
+    static constexpr bool timed = false;
+
+    struct Snapshot {
+        size_t allocs;
+        size_t frees;
+        size_t bigAllocs;
+        size_t bigFrees;
+
+        // Bytes currently held by live BigAllocs, including headers.
+        size_t bigBytes;
+        size_t arenasCreated;
+        size_t arenasReleased;
+
+        // Times each slow path was taken, indexed by SlowPath.
+        size_t slowPaths[numSlowPaths];
+
+        // Class lock acquisitions that found the lock taken.
+        size_t lockWaits;
+
+        size_t slowPath(SlowPath path) const {
+            return slowPaths[static_cast<size_t>(path)];
+        }
+    };
+
+    void onAlloc(size_t cls) { m_allocs.fetch_add(1, std::memory_order_relaxed); }
+    void onFree(size_t cls) { m_frees.fetch_add(1, std::memory_order_relaxed); }
+
+    void onBigAlloc(size_t bytes) {
+        m_bigAllocs.fetch_add(1, std::memory_order_relaxed);
+        m_bigBytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void onBigFree(size_t bytes) {
+        m_bigFrees.fetch_add(1, std::memory_order_relaxed);
+        m_bigBytes.fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    void onArenaCreate(size_t cls) { m_arenasCreated.fetch_add(1, std::memory_order_relaxed); }
+    void onArenaRelease(size_t cls) { m_arenasReleased.fetch_add(1, std::memory_order_relaxed); }
+
+    void onSlowPath(SlowPath path, uint64_t nanos) {
+        m_slowPaths[static_cast<size_t>(path)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void onLockWait(size_t cls, uint64_t nanos) { m_lockWaits.fetch_add(1, std::memory_order_relaxed); }
+
+    Snapshot snapshot() const {
+        Snapshot snapshot = {
+            m_allocs.load(std::memory_order_relaxed),
+            m_frees.load(std::memory_order_relaxed),
+            m_bigAllocs.load(std::memory_order_relaxed),
+            m_bigFrees.load(std::memory_order_relaxed),
+            m_bigBytes.load(std::memory_order_relaxed),
+            m_arenasCreated.load(std::memory_order_relaxed),
+            m_arenasReleased.load(std::memory_order_relaxed),
+            {},
+            m_lockWaits.load(std::memory_order_relaxed),
+        };
+
+        for (size_t i = 0; i < numSlowPaths; i++) {
+            snapshot.slowPaths[i] = m_slowPaths[i].load(std::memory_order_relaxed);
+        }
+
+        return snapshot;
+    }
+};
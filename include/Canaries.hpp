@@ -0,0 +1,303 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+
+/**
+ * What a canary caught.
+ */
+enum class CanaryFault {
+    // A sampled slot was freed again while still in quarantine.
+    DoubleFree,
+    // A sampled slot was written to after it was freed.
+    WriteAfterFree,
+    // validate() was asked about a sampled slot that has been freed.
+    UseAfterFree
+};
+
+/**
+ * Called when a canary catches a bug, with the slot and the generation it was
+ * tagged with. It may run with allocator locks held, so it must not allocate
+ * or free through the allocator.
+ */
+using CanaryHandler = void (*)(CanaryFault fault, const void* slot, uint32_t generation);
+
+/**
+ * Where canary faults go, process-wide. With no handler installed a fault is
+ * written to stderr and the process aborts.
+ */
+class CanaryReports {
+    inline static std::atomic<CanaryHandler> s_handler{nullptr};
+
+public:
+    static void setHandler(CanaryHandler handler) {
+        s_handler.store(handler, std::memory_order_release);
+    }
+
+    static void report(CanaryFault fault, const void* slot, uint32_t generation) {
+        CanaryHandler handler = s_handler.load(std::memory_order_acquire);
+
+        if (handler == nullptr) {
+            reportAndAbort(fault, slot, generation);
+        }
+
+        handler(fault, slot, generation);
+    }
+
+    [[noreturn]] static void reportAndAbort(CanaryFault fault, const void* slot, uint32_t generation);
+};
+
+/**
+ * Canary policy: no canaries. The default.
+ */
+struct NoCanaries {
+    static constexpr bool enabled = false;
+    static constexpr size_t trailerSize = 0;
+
+    void lock() { }
+    void unlock() { }
+};
+
+/**
+ * Canary policy for production builds: roughly one arena allocation in Period
+ * is sampled, which costs a countdown per allocation and nothing per free.
+ *
+ * ArenaStore serves sampled allocations from arenas of their own, under the
+ * class lock, from a slot at least a word larger than asked for. That last
+ * word holds a tag: a hash of the slot's address, a generation number and
+ * whether the slot is live or freed. Freeing a sampled slot marks it freed,
+ * fills it with a poison byte and parks it in a quarantine of QuarantineSlots
+ * slots rather than reusing it. That catches:
+ *
+ * - a double free, when the slot is freed again while in quarantine, or
+ *   after it has left quarantine and before it is handed out again;
+ * - a write after free, when the poison has changed by the time the slot is
+ *   evicted from quarantine and really freed;
+ * - a use after free, when validate() is called on a pointer into the slot
+ *   while it is free.
+ */
+template <size_t Period = 1000, size_t QuarantineSlots = 64> class SampledCanaries {
+    static_assert(Period > 0 && QuarantineSlots > 0, "Period and QuarantineSlots must be positive");
+
+    static constexpr uint8_t liveState = 0x5a;
+    static constexpr uint8_t freedState = 0xd1;
+    static constexpr uint8_t poison = 0xdb;
+
+    struct Quarantined {
+        void* slot;
+        size_t size;
+    };
+
+    // Allocations left until the calling thread's next sample, and the state
+    // of the generator that spaces samples out.
+    inline static thread_local size_t t_countdown = 0;
+    inline static thread_local uint64_t t_random = 0;
+
+    // Guards the quarantine. It is a leaf: nothing else is locked under it.
+    std::mutex m_mutex;
+    Quarantined m_quarantine[QuarantineSlots] = {};
+    size_t m_oldest = 0;
+    size_t m_count = 0;
+
+    std::atomic<uint32_t> m_generation{0};
+    std::atomic<size_t> m_sampled{0};
+    std::atomic<size_t> m_faults{0};
+
+    // The tag word. validate() and the heap walker read it without m_mutex,
+    // so it is only ever accessed atomically.
+    static std::atomic<uint64_t>& trailer(const void* slot, size_t size) {
+        char* end = const_cast<char*>(static_cast<const char*>(slot)) + size;
+
+        return *reinterpret_cast<std::atomic<uint64_t>*>(end - sizeof(uint64_t));
+    }
+
+    static uint64_t tag(const void* slot, uint32_t generation, uint8_t state) {
+        uint64_t hash = (reinterpret_cast<uintptr_t>(slot) * 0x9e3779b97f4a7c15) >> 32;
+
+        return hash << 32 | uint64_t(generation & 0xffffff) << 8 | state;
+    }
+
+    static uint32_t generationOf(uint64_t tag) {
+        return static_cast<uint32_t>(tag >> 8 & 0xffffff);
+    }
+
+    /**
+     * The state of the slot's tag, or 0 if the slot isn't tagged.
+     */
+    static uint8_t stateOf(const void* slot, uint64_t word) {
+        uint8_t state = static_cast<uint8_t>(word);
+
+        if ((state != liveState && state != freedState) || word != tag(slot, generationOf(word), state)) {
+            return 0;
+        }
+
+        return state;
+    }
+
+    void fault(CanaryFault fault, const void* slot, uint32_t generation) {
+        m_faults.fetch_add(1, std::memory_order_relaxed);
+        CanaryReports::report(fault, slot, generation);
+    }
+
+    /**
+     * Checks that an evicted slot still holds nothing but poison and clears
+     * its tag. m_mutex must be held.
+     */
+    void release(const Quarantined& entry) {
+        std::atomic<uint64_t>& word = trailer(entry.slot, entry.size);
+        const char* bytes = static_cast<const char*>(entry.slot);
+
+        for (size_t i = 0; i < entry.size - sizeof(uint64_t); i++) {
+            if (static_cast<uint8_t>(bytes[i]) != poison) {
+                fault(CanaryFault::WriteAfterFree, entry.slot, generationOf(word.load(std::memory_order_relaxed)));
+                break;
+            }
+        }
+
+        word.store(0, std::memory_order_relaxed);
+    }
+
+public:
+    static constexpr bool enabled = true;
+    static constexpr size_t trailerSize = sizeof(uint64_t);
+
+    constexpr SampledCanaries() = default;
+    SampledCanaries(const SampledCanaries& other) = delete;
+
+    /**
+     * Whether the calling thread's next allocation should be tagged. Samples
+     * are spaced a random 1 to 2 * Period - 1 allocations apart, so a pattern
+     * that repeats every Period allocations doesn't hide from them.
+     */
+    bool sample() {
+        if (t_countdown > 1) {
+            t_countdown--;
+            return false;
+        }
+
+        if (t_random == 0) {
+            t_random = reinterpret_cast<uintptr_t>(&t_random) | 1;
+        }
+
+        // xorshift64
+        t_random ^= t_random << 13;
+        t_random ^= t_random >> 7;
+        t_random ^= t_random << 17;
+
+        bool first = t_countdown == 0;
+        t_countdown = Period > 1 ? 1 + t_random % (2 * Period - 1) : 1;
+
+        // A fresh thread starts part way through a period instead of sampling
+        // its very first allocation.
+        return !first || Period == 1;
+    }
+
+    /**
+     * Tags a freshly allocated slot of `size` bytes as live.
+     */
+    void arm(void* slot, size_t size) {
+        uint32_t generation = m_generation.fetch_add(1, std::memory_order_relaxed) + 1;
+
+        trailer(slot, size).store(tag(slot, generation, liveState), std::memory_order_relaxed);
+        m_sampled.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Puts a sampled slot of `size` bytes that is being freed into quarantine.
+     * Returns whatever its arrival pushed out, checked and untagged, for the
+     * caller to really free; that may belong to another arena. Returns nullptr
+     * if nothing was pushed out, or if the slot wasn't live, which is reported
+     * as a double free.
+     */
+    void* retire(void* slot, size_t size) {
+        std::atomic<uint64_t>& word = trailer(slot, size);
+        std::lock_guard<std::mutex> guard(m_mutex);
+        uint64_t live = word.load(std::memory_order_relaxed);
+
+        if (stateOf(slot, live) != liveState) {
+            fault(CanaryFault::DoubleFree, slot, generationOf(live));
+            return nullptr;
+        }
+
+        memset(slot, poison, size - sizeof(uint64_t));
+        word.store(tag(slot, generationOf(live), freedState), std::memory_order_relaxed);
+
+        void* evicted = nullptr;
+
+        if (m_count == QuarantineSlots) {
+            Quarantined& oldest = m_quarantine[m_oldest];
+            release(oldest);
+            evicted = oldest.slot;
+            m_oldest = (m_oldest + 1) % QuarantineSlots;
+            m_count--;
+        }
+
+        m_quarantine[(m_oldest + m_count) % QuarantineSlots] = Quarantined{slot, size};
+        m_count++;
+
+        return evicted;
+    }
+
+    /**
+     * Takes the oldest slot out of quarantine, checked and untagged, for the
+     * caller to really free. Returns nullptr once the quarantine is empty.
+     */
+    void* evict() {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        if (m_count == 0) {
+            return nullptr;
+        }
+
+        Quarantined& oldest = m_quarantine[m_oldest];
+        release(oldest);
+        m_oldest = (m_oldest + 1) % QuarantineSlots;
+        m_count--;
+
+        return oldest.slot;
+    }
+
+    /**
+     * Returns true if the sampled slot is live; otherwise reports a use after
+     * free and returns false.
+     */
+    bool validate(const void* slot, size_t size) {
+        uint64_t word = trailer(slot, size).load(std::memory_order_relaxed);
+
+        if (stateOf(slot, word) == liveState) {
+            return true;
+        }
+
+        fault(CanaryFault::UseAfterFree, slot, generationOf(word));
+
+        return false;
+    }
+
+    /**
+     * Whether a slot of a sampled arena is tagged live: handed out and not
+     * freed since. Slots in quarantine are not.
+     */
+    bool live(const void* slot, size_t size) const {
+        return stateOf(slot, trailer(slot, size).load(std::memory_order_relaxed)) == liveState;
+    }
+
+    // Held across fork() with the store's other locks.
+    void lock() { m_mutex.lock(); }
+    void unlock() { m_mutex.unlock(); }
+
+    /**
+     * The number of allocations tagged so far.
+     */
+    size_t sampled() const {
+        return m_sampled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * The number of faults caught so far.
+     */
+    size_t faults() const {
+        return m_faults.load(std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,89 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <ostream>
+
+/**
+ * One live allocation, as reported by ArenaStore::walk().
+ */
+struct HeapObject {
+    enum class Tier {
+        Arena,
+        Medium,
+        Big
+    };
+
+    void* address;
+    size_t usableSize;
+    Tier tier;
+
+    // The size class within the tier. Always 0 for BigAllocs.
+    size_t sizeClass;
+};
+
+/**
+ * Live allocations of a store, bucketed by size class, in the spirit of
+ * glibc's malloc_info. Built by ArenaStore::summary().
+ */
+struct HeapSummary {
+    static constexpr size_t maxBuckets = 64;
+
+    // One bucket per arena class, then per medium class, then one for every
+    // BigAlloc. Empty buckets are kept, so bucket i is always the same class.
+    struct Bucket {
+        size_t from;
+        size_t to;
+        size_t count;
+        size_t bytes;
+    };
+
+    Bucket buckets[maxBuckets];
+    size_t numBuckets;
+
+    // Live objects and their usable bytes, per HeapObject::Tier.
+    size_t objects[3];
+    size_t bytes[3];
+
+    // What holds them: arenas, medium chunks and BigAlloc mappings.
+    size_t arenas;
+    size_t mediumChunks;
+    size_t bigAllocs;
+
+    // Process-wide bytes mapped by the stores; see MMapObject::mappedBytes().
+    size_t mappedBytes;
+};
+
+/**
+ * Writes a summary out as XML, laid out like malloc_info's.
+ */
+void printMallocInfo(const HeapSummary& summary, std::ostream& out);
+
+/**
+ * Lists the live objects of a store, for a leak check: a count and total, then
+ * the first `maxListed` objects. Returns the number of live objects.
+ */
+template <typename Store>
+size_t reportLiveObjects(Store& store, std::ostream& out, size_t maxListed = 16) {
+    static const char* tiers[] = { "arena", "medium", "big" };
+
+    size_t count = 0;
+    size_t bytes = 0;
+
+    store.walk([&](const HeapObject& object) {
+        if (count < maxListed) {
+            out << "  " << object.address << ": " << object.usableSize << " bytes ("
+                << tiers[static_cast<size_t>(object.tier)] << " class " << object.sizeClass << ")\n";
+        }
+
+        count++;
+        bytes += object.usableSize;
+    });
+
+    if (count > maxListed) {
+        out << "  ... and " << count - maxListed << " more\n";
+    }
+
+    out << count << " objects (" << bytes << " bytes) still live\n";
+
+    return count;
+}
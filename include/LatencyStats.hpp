@@ -0,0 +1,239 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+#include <ostream>
+
+#include <AllocatorPolicies.hpp>
+
+/**
+ * Nanoseconds on the monotonic clock.
+ */
+inline uint64_t monotonicNanos() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return uint64_t(now.tv_sec) * 1'000'000'000 + now.tv_nsec;
+}
+
+/**
+ * A lock-free log-linear histogram in the style of HdrHistogram. Each power of
+ * two is split into 8 buckets, so a recorded value is reported with at most
+ * 12.5% error over the full 64-bit range, in 4 KiB of counters.
+ */
+class LatencyHistogram {
+    static constexpr size_t subBits = 3;
+    static constexpr size_t subBuckets = size_t(1) << subBits;
+    static constexpr size_t numBuckets = (64 - subBits + 1) * subBuckets;
+
+    std::atomic<uint64_t> m_buckets[numBuckets] = {};
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_sum{0};
+    std::atomic<uint64_t> m_max{0};
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < subBuckets) {
+            return value;
+        }
+
+        size_t exponent = 63 - __builtin_clzll(value);
+        size_t sub = (value >> (exponent - subBits)) & (subBuckets - 1);
+
+        return (exponent - subBits + 1) * subBuckets + sub;
+    }
+
+    // The largest value that lands in the bucket.
+    static uint64_t upperBound(size_t bucket) {
+        if (bucket < subBuckets) {
+            return bucket;
+        }
+
+        size_t exponent = bucket / subBuckets + subBits - 1;
+        uint64_t width = uint64_t(1) << (exponent - subBits);
+
+        return (subBuckets + bucket % subBuckets) * width + width - 1;
+    }
+
+public:
+    struct Summary {
+        uint64_t count;
+        uint64_t mean;
+        uint64_t p50;
+        uint64_t p99;
+        uint64_t p999;
+        uint64_t max;
+    };
+
+    void record(uint64_t value) {
+        m_buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(value, std::memory_order_relaxed);
+
+        uint64_t max = m_max.load(std::memory_order_relaxed);
+
+        while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) { }
+    }
+
+    uint64_t count() const {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+    uint64_t max() const {
+        return m_max.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * The value below which `fraction` (0 to 1) of the recorded values fall,
+     * rounded up to its bucket's bound. 0 if nothing has been recorded.
+     */
+    uint64_t percentile(double fraction) const {
+        uint64_t total = 0;
+
+        for (size_t i = 0; i < numBuckets; i++) {
+            total += m_buckets[i].load(std::memory_order_relaxed);
+        }
+
+        uint64_t target = static_cast<uint64_t>(fraction * total + 0.5);
+        target = target == 0 ? 1 : target;
+        uint64_t seen = 0;
+
+        for (size_t i = 0; i < numBuckets; i++) {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+
+            if (total > 0 && seen >= target) {
+                uint64_t bound = upperBound(i);
+                return bound < max() ? bound : max();
+            }
+        }
+
+        return 0;
+    }
+
+    Summary summary() const {
+        uint64_t count = this->count();
+
+        return Summary {
+            count,
+            count > 0 ? m_sum.load(std::memory_order_relaxed) / count : 0,
+            percentile(0.5),
+            percentile(0.99),
+            percentile(0.999),
+            max(),
+        };
+    }
+};
+
+/**
+ * Stats policy for finding out what the allocator's tail latency is made of.
+ * On top of CountingStats it times every slow path and every contended class
+ * lock acquisition into histograms, and reports them with the page syscall
+ * counts. Fast paths are only counted, never timed.
+ */
+class LatencyStats : public CountingStats {
+    LatencyHistogram m_slowPaths[numSlowPaths];
+    LatencyHistogram m_lockWait;
+
+public:
+    static constexpr bool timed = true;
+
+    struct Report {
+        CountingStats::Snapshot counts;
+
+        // Allocs and frees of arena-sized items served by the thread cache
+        // alone, and everything else (including medium and BigAllocs).
+        size_t fastAllocs;
+        size_t slowAllocs;
+        size_t fastFrees;
+        size_t slowFrees;
+
+        // Process-wide, not just this store's.
+        PageSyscalls::Snapshot syscalls;
+
+        // Nanoseconds, indexed by SlowPath.
+        LatencyHistogram::Summary slowPaths[numSlowPaths];
+        LatencyHistogram::Summary lockWait;
+    };
+
+    void onSlowPath(SlowPath path, uint64_t nanos) {
+        CountingStats::onSlowPath(path, nanos);
+        m_slowPaths[static_cast<size_t>(path)].record(nanos);
+    }
+
+    void onLockWait(size_t cls, uint64_t nanos) {
+        CountingStats::onLockWait(cls, nanos);
+        m_lockWait.record(nanos);
+    }
+
+    const LatencyHistogram& slowPath(SlowPath path) const {
+        return m_slowPaths[static_cast<size_t>(path)];
+    }
+
+    const LatencyHistogram& lockWait() const {
+        return m_lockWait;
+    }
+
+    Report report() const {
+        Report report = {};
+        report.counts = snapshot();
+
+        const auto& counts = report.counts;
+        size_t mediumAllocs = counts.slowPath(SlowPath::MediumAlloc);
+        size_t mediumFrees = counts.slowPath(SlowPath::MediumFree);
+
+        report.slowAllocs = counts.slowPath(SlowPath::Refill)
+            + counts.slowPath(SlowPath::LockedAlloc)
+            + mediumAllocs
+            + counts.bigAllocs;
+        report.fastAllocs = counts.allocs + mediumAllocs + counts.bigAllocs - report.slowAllocs;
+        report.slowFrees = counts.slowPath(SlowPath::Flush)
+            + counts.slowPath(SlowPath::LockedFree)
+            + mediumFrees
+            + counts.bigFrees;
+        report.fastFrees = counts.frees + mediumFrees + counts.bigFrees - report.slowFrees;
+
+        report.syscalls = PageSyscalls::snapshot();
+
+        for (size_t i = 0; i < numSlowPaths; i++) {
+            report.slowPaths[i] = m_slowPaths[i].summary();
+        }
+
+        report.lockWait = m_lockWait.summary();
+
+        return report;
+    }
+
+    /**
+     * Writes report() out as text, one line per slow path.
+     */
+    void print(std::ostream& out) const {
+        static const char* names[numSlowPaths] = {
+            "refill", "flush", "locked-refill", "locked-flush", "locked-alloc", "locked-free", "arena-create",
+            "big-alloc", "big-free", "medium-alloc", "medium-free"
+        };
+
+        Report report = this->report();
+
+        out << "allocs: " << report.fastAllocs << " fast, " << report.slowAllocs << " slow\n"
+            << "frees: " << report.fastFrees << " fast, " << report.slowFrees << " slow\n"
+            << "syscalls: " << report.syscalls.mmaps << " mmap, "
+            << report.syscalls.munmaps << " munmap, "
+            << report.syscalls.mprotects << " mprotect, "
+            << report.syscalls.madvises << " madvise\n";
+
+        auto line = [&](const char* name, const LatencyHistogram::Summary& summary) {
+            out << name << ": n=" << summary.count
+                << " mean=" << summary.mean
+                << "ns p50=" << summary.p50
+                << "ns p99=" << summary.p99
+                << "ns p99.9=" << summary.p999
+                << "ns max=" << summary.max << "ns\n";
+        };
+
+        for (size_t i = 0; i < numSlowPaths; i++) {
+            line(names[i], report.slowPaths[i]);
+        }
+
+        line("lock-wait", report.lockWait);
+    }
+};
@@ -0,0 +1,74 @@
+#pragma once
+#include <stddef.h>
+#include <atomic>
+
+/**
+ * Process and thread lifecycle hooks for allocator components.
+ *
+ * Around fork(), prepareFork runs for every registered component and takes its
+ * locks so that no other thread is half way through touching its state; the
+ * parent then just releases them, while the child releases them and drops
+ * whatever belonged to threads that don't exist in it. Components in a lower
+ * tier are prepared first and released last, which must match the order their
+ * locks nest in otherwise.
+ *
+ * threadExit runs on a thread that is exiting, with the thread's index, before
+ * the index is handed to anyone else.
+ *
+ * releaseMemory runs under memory pressure (see MemoryLimits.hpp), from a
+ * thread holding no allocator locks, lower tiers first: stores give back their
+ * empty arenas before page policies purge what that freed.
+ */
+struct LifecycleHooks {
+    enum Tier {
+        // ArenaStores. Their class locks are held while mapping pages.
+        StoreTier = 0,
+        // Page policies.
+        PageTier = 1,
+        numTiers = 2
+    };
+
+    void (*prepareFork)(void* context);
+    void (*parentFork)(void* context);
+    void (*childFork)(void* context, size_t survivingIndex);
+    void (*threadExit)(void* context, size_t index);
+    void (*releaseMemory)(void* context);
+    void* context;
+    Tier tier;
+
+    // Owned by the registry.
+    LifecycleHooks* next;
+    std::atomic<bool> registered;
+};
+
+/**
+ * Adds hooks to the registry, once; later calls with the same hooks do
+ * nothing. Must not be called with any allocator lock held.
+ */
+void registerLifecycleHooks(LifecycleHooks* hooks);
+
+/**
+ * Removes hooks from the registry, waiting out any hook currently running.
+ */
+void unregisterLifecycleHooks(LifecycleHooks* hooks);
+
+/**
+ * Runs every registered threadExit hook for the given thread index.
+ */
+void runThreadExitHooks(size_t index);
+
+/**
+ * Runs every registered releaseMemory hook. Must not be called with any
+ * allocator lock held.
+ */
+void runMemoryPressureHooks();
+
+/**
+ * Registers hooks unless they already are. Costs a single load once they
+ * are.
+ */
+inline void ensureLifecycleHooks(LifecycleHooks* hooks) {
+    if (!hooks->registered.load(std::memory_order_acquire)) {
+        registerLifecycleHooks(hooks);
+    }
+}
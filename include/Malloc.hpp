@@ -11,33 +11,31 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <stdio.h>
-#include <mutex> 
 #include <iostream>
 
- 
+#include <AllocatorPolicies.hpp>
+#include <ReservedPages.hpp>
+#include <ThreadCache.hpp>
+#include <LatencyStats.hpp>
+#include <Lifecycle.hpp>
+#include <MemoryLimits.hpp>
+#include <HeapWalk.hpp>
+#include <Canaries.hpp>
 
-#define ALIGNMENT 8
-#define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
- 
 class MMapObject;
-class ArenaStore;
 class Arena;
-//std::mutex mtx; 
+//std::mutex mtx;
 //MMapObject* This = nullptr;
 
 //class Arena;
 //Arena* ArenaThis  = nullptr;
-// You can assume this as your page size. On some OSs (e.g. macOS), 
-// it may in fact be larger and you'll waste memory due to internal 
-// fragmentation as a result, but that's okay for this exercise.
-constexpr size_t pageSize = 4096;
  const int JOB_SCHEDULER_SIZE = 256;
   const int COMPLEX_SIZE = 128;
   const int COORDINATE_SIZE = 64;
   const int POOL_SIZE = 1024; //number of elements in a single pool
-            //can be chosen based on application requirements 
+            //can be chosen based on application requirements
 
-  const int MAX_BLOCK_SIZE = 36; //depending on the application it may change 
+  const int MAX_BLOCK_SIZE = 36; //depending on the application it may change
                 //In above case it came as 36
 
 
@@ -55,11 +53,11 @@ class MMapObject {
     // outstanding pages there are.
     static std::atomic<size_t> s_outstandingPages;
 public:
-    
+
     MMapObject(const MMapObject& other) = delete;
     MMapObject(){}
-    
-    
+
+
     /**
      * The number of contiguous bytes in this mmap allocation.
      */
@@ -86,57 +84,68 @@ public:
     }
 
     /**
-     * This function should call mmap to allocate a contiguous set of pages with
-     * the passed size. If the caller is intending to use this region as an arena,
-     * they should set arenaSize to the size of its items.
-     * 
+     * Maps a contiguous set of pages with the passed size through PagePolicy.
+     * If the caller is intending to use this region as an arena, they should
+     * set arenaSize to the size of its items.
+     *
      * If this is a large allocation, the caller should set arenaSize to 0.
+     * Returns nullptr if the pages couldn't be mapped, if MemoryLimits' hard
+     * cap refused them, or if `size` is too close to SIZE_MAX to round up.
      */
+    template <typename PagePolicy = DefaultPages>
     static MMapObject* alloc(size_t size, size_t arenaSize) {
+        if (size > SIZE_MAX - (PagePolicy::pageSize - 1)) {
+            return nullptr;
+        }
+
+        void* region = CountedPages::map<PagePolicy>(size);
+
+        if (region == nullptr) {
+            return nullptr;
+        }
+
         s_outstandingPages++;
 
-        MMapObject* sd;
-        sd->setmmapSize(size);
-        sd->setarenaSize(arenaSize);
-        mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANON, -1, 0);
+        MMapObject* obj = reinterpret_cast<MMapObject*>(region);
+        obj->setmmapSize(size);
+        obj->setarenaSize(arenaSize);
 
-        return sd;
+        return obj;
     }
 
     /**
-     * This function should deallocate the passed pointer by calling munmap.
+     * Returns the MMapObject containing ptr.
+     *
+     * Arenas are never larger than PagePolicy::pageSize and BigAllocs always
+     * return a pointer to just after the MMapObject header, so jumping back to
+     * the nearest multiple of the page size lands on the header.
+     */
+    template <typename PagePolicy = DefaultPages>
+    static MMapObject* owner(void* ptr) {
+        return reinterpret_cast<MMapObject*>(
+            reinterpret_cast<uintptr_t>(ptr) & ~(PagePolicy::pageSize - 1)
+        );
+    }
+
+    /**
+     * Deallocates the region containing the passed pointer by unmapping it.
      * The passed pointer may not be at the start of the memory region, but will
-     * be within it, so you'll need to calculate the start of the MMapObject* ptr,
-     * passing that as start of the region to unmap and ptr->mmapSize() as its length.
-     * 
-     * Recall that Arenas will never be larger than the OS page size and BigAllocs
-     * always return a pointer to just after the MMapObject header, so you can
-     * jump back to the nearest multiple of page size and that will be the MMapObject*.
+     * be within it; see owner().
      */
+    template <typename PagePolicy = DefaultPages>
     static void dealloc(void* ptr) {
         size_t old = s_outstandingPages--;
-        MMapObject *obj = reinterpret_cast<MMapObject *>(ptr);
-        //reinterpret_cast<MMapObject*>(((char*)data - sizeof(BigAlloc)));
+        MMapObject *obj = owner<PagePolicy>(ptr);
 
         // If there previously 0 pages, then we goofed and tried to free more pages
         // than we allocated. This is a serious bug, so sigtrap and your debugger
         // can break on this line. If not debugging, you'll get a SIGTRAP message
         // and your program will exit.
-         // TODO: munmap deallocation code
         if (old == 0) {
-            //raise(SIGTRAP);
-            munmap(0, obj->mmapSize());
+            raise(SIGTRAP);
         }
-        else{
-            for(size_t i = 0; i <= old; i++)
-            {
-                void *addr = reinterpret_cast <void*>(i * obj->mmapSize());
-                munmap(addr, obj->mmapSize());
-            }
-        }
-        s_outstandingPages = 0;
-        obj->setmmapSize(0);
-        obj->setarenaSize(0);
+
+        CountedPages::unmap<PagePolicy>(obj, obj->mmapSize());
     }
 
     /**
@@ -146,75 +155,58 @@ public:
     static size_t outstandingPages() {
         return s_outstandingPages.load();
     }
+
+    /**
+     * Bytes mapped by every store, MMapObjects or not. See CountedPages.
+     */
+    static size_t mappedBytes() {
+        return CountedPages::mappedBytes();
+    }
 };
 
 class BigAlloc : public MMapObject {
     // This inherits from MMapObject, so it also has the mmapSize and arenSize
     // members as well.
 
-    size_t sizeT;
+    // Links in the owning ArenaStore's list of live BigAllocs, under its
+    // big-alloc lock.
+    BigAlloc* m_prev;
+    BigAlloc* m_next;
 
-    struct FreeStore
-    {
-     FreeStore* next;
-    }; 
-    void expandPoolSize()
-    {
-            size_t size = (sizeof(volatile char*) > sizeof(FreeStore*)) ?
-            sizeof(volatile char*) : sizeof(FreeStore*);
-            FreeStore* head = reinterpret_cast <FreeStore*> (new char[size]);
-            freeStoreHead = head;
-            for (int i = 0; i < sizeT; i++) {
-                head->next = reinterpret_cast <FreeStore*> (new char[size]);
-                head = head->next;
-            }
-            head->next = 0;
-    }
+    // The allocation itself starts here, after the header padded out to
+    // maxAlignment.
+    alignas(maxAlignment) char m_data[0];
 
-    void cleanUp()
-    {
-        FreeStore* nextPtr = freeStoreHead;
-        for (; nextPtr; nextPtr = freeStoreHead) {
-            freeStoreHead = freeStoreHead->next;
-            delete[] nextPtr; // remember this was a char array
-        }
-    }
-    FreeStore* freeStoreHead = 0;
-    char m_data[0];
+    template <typename, typename, typename, typename, typename, typename> friend class ArenaStore;
 
 public:
     BigAlloc(const BigAlloc& other) = delete;
 
-    BigAlloc(){
-        freeStoreHead = 0;
-        expandPoolSize();
-    } 
-      
-    virtual ~BigAlloc() { 
-      cleanUp();
-    }
-
-    /**
-     * This method should allocate a single large contiguous block of memory using
-     * MMapObject::alloc(). You then need to treat that pointer as a BigAlloc*
-     * and return the address of the allocation *after* the header.
-     * 
-     * The returned address must be 64-bit aligned.
-     */
-     static void* alloc(size_t size) {
-        // TODO: allocate the BigAlloc.
-       // pthread_mutex_lock (&lock); 
-       MMapObject* p = (BigAlloc*)MMapObject::alloc(size, 0);
-       BigAlloc* j = static_cast<BigAlloc*>(p); 
-       if(!j) return nullptr;
-       j->sizeT = size; 
-        if(0 == j->freeStoreHead)
-            j->expandPoolSize();
-        FreeStore* head = j->freeStoreHead;
-        j->freeStoreHead = head->next;
-        void *v = reinterpret_cast <void*>(head);
-        return v;
-       // pthread_mutex_unlock (&lock);
+    /**
+     * Allocates a single large contiguous block of memory using
+     * MMapObject::alloc() and returns the address of the allocation *after*
+     * the header.
+     *
+     * The returned address is aligned to maxAlignment. Returns nullptr if
+     * the header and the page round-up would overflow size_t.
+     */
+    template <typename PagePolicy = DefaultPages>
+    static void* alloc(size_t size) {
+        if (size > SIZE_MAX - sizeof(BigAlloc) - (PagePolicy::pageSize - 1)) {
+            return nullptr;
+        }
+
+        MMapObject* obj = MMapObject::alloc<PagePolicy>(size + sizeof(BigAlloc), 0);
+
+        if (obj == nullptr) {
+            return nullptr;
+        }
+
+        BigAlloc* big = static_cast<BigAlloc*>(obj);
+        big->m_prev = nullptr;
+        big->m_next = nullptr;
+
+        return big->m_data;
     }
 };
 
@@ -224,23 +216,38 @@ class Arena : public MMapObject {
     // This inherits from MMapObject, so it also has the mmapSize and arenSize
     // members as well.
 
-    // You'll need some means of tracking the number of freed items in this arena
-    // in a thread-safe manner. That should go here.
-    // mything thing = stuff;
-    uint8_t *region;
-    size_t size;
-    size_t current;
-    Arena *nextArena = nullptr;
-    size_t allocations = 0;
-    size_t expectedAllocations;
-
-    // A pointer to the next free address in the arena.
+    // Freed slots are threaded through their own first word.
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    // A pointer to the next never-used slot in the arena. Slots are handed out
+    // by bumping this until the arena has been carved up completely.
     char* m_next;
 
+    // Slots returned by free(), reused before bumping m_next.
+    FreeSlot* m_freeList;
+
+    // Links in the owning ArenaStore's list of arenas with free slots.
+    Arena* m_prevArena;
+    Arena* m_nextArena;
+
+    // Number of slots in this arena and how many of them are handed out. The
+    // owning ArenaStore serializes access with its per-class lock.
+    uint32_t m_capacity;
+    uint32_t m_allocated;
+
+    // The owning ArenaStore's size class. Classes may share a slot size (see
+    // CacheLineIsolated), so it can't be worked out from arenaSize().
+    uint32_t m_sizeClass;
+
+    // Whether the arena only serves allocations sampled for canaries (see
+    // Canaries.hpp). Its slots never pass through the thread caches.
+    bool m_sampled;
+
     // This might look kind of weird as it's size is zero, but this serves as a surrogate
-    // location to start of the arena's allocation slots. That is &this->m_data[0] is a pointer
-    // to the first allocation slot, &this->m_data[arenaSize()] is a pointer to the second
-    // and so forth.
+    // location to the end of the header. The slots start at or just after it, at
+    // slotOffset(arenaSize()).
     //
     // Note, if you put any data members in this class, you must put them *before* this.
     // Additionally, you need to ensure this address is 64-bit aligned, so you need appropriate
@@ -249,39 +256,47 @@ class Arena : public MMapObject {
     // If sizeof(Arena) % 8 == 0, you should be good.
     char* m_data[0];
 
+    template <typename, typename, typename, typename, typename, typename> friend class ArenaStore;
+
 public:
-    
+
     /**
-     * Creates an arena with items of the given size. You should allocate with
-     * MMapObject::alloc() and coerce the result into an Arena*.
+     * Where the first slot of an arena of itemSize items starts: just past the
+     * header, rounded up so every slot is aligned to the largest power of two
+     * dividing itemSize, up to maxAlignment. For power-of-two sizes that costs
+     * no slots, and it puts 64-byte items on cache lines of their own.
      */
-    static Arena* create(uint32_t itemSize) {
-        // TODO: create and initialize the arena.
-        MMapObject* pointer_variable = MMapObject::alloc(pageSize, itemSize);
-        Arena* arena =  static_cast <Arena*>(pointer_variable); 
-        if(!arena) return nullptr;
-        arena->region = (uint8_t *) ::calloc(itemSize, sizeof(uint8_t));
-        if(!arena->region) { 
-            ::free(arena); 
-            return nullptr; 
-        }
-
-        arena->expectedAllocations = (pageSize - sizeof(Arena)) / itemSize;
-        arena->size = itemSize;
-        return arena;
+    static constexpr size_t slotOffset(size_t itemSize) {
+        size_t align = itemSize & (~itemSize + 1);
+        align = align < maxAlignment ? align : maxAlignment;
+
+        return (sizeof(Arena) + align - 1) & ~(align - 1);
     }
 
-    void deallocate(){
-        // mtx.lock();
-        Arena *nextptr, *last = this;
-        do {
-            nextptr = last->nextArena;
-            ::free(last->region);
-            ::free(last);
-            allocations--;
-            last = nextptr;
-        } while(nextptr != nullptr);
-        //  mtx.unlock();
+    /**
+     * Creates an arena with items of the given size, spanning one
+     * PagePolicy::pageSize region. Returns nullptr if the pages couldn't be
+     * mapped.
+     */
+    template <typename PagePolicy = DefaultPages>
+    static Arena* create(uint32_t itemSize) {
+        MMapObject* obj = MMapObject::alloc<PagePolicy>(PagePolicy::pageSize, itemSize);
+
+        if (obj == nullptr) {
+            return nullptr;
+        }
+
+        Arena* arena = static_cast<Arena*>(obj);
+        arena->m_next = reinterpret_cast<char*>(arena) + slotOffset(itemSize);
+        arena->m_freeList = nullptr;
+        arena->m_prevArena = nullptr;
+        arena->m_nextArena = nullptr;
+        arena->m_capacity = static_cast<uint32_t>((PagePolicy::pageSize - slotOffset(itemSize)) / itemSize);
+        arena->m_allocated = 0;
+        arena->m_sizeClass = 0;
+        arena->m_sampled = false;
+
+        return arena;
     }
 
     /**
@@ -289,154 +304,1741 @@ public:
      * have already exceeded the bounds of the arena.
      */
     void* alloc() {
-        // mtx.unlock();
-        // TODO: return a pointer to an item in this arena. We should return nullptr
-        // if there are no more slots in which to allocate data.
-       // return arena_alloc_align(sizeof(char), ALIGNMENT);
-       if(allocations == expectedAllocations)
-       {
-           return nullptr;
-       }
-       else
-       {
-           Arena *last, *loop = this;
-
-            do {
-            if((size - current) >= pageSize){
-                current += pageSize;
-                return region + (current - pageSize);
-            }
-            } while((loop = loop->nextArena) != nullptr);
-
-            Arena *nextptr  = Arena::create(pageSize);
-            last->nextArena     = nextptr;
-            loop->current += pageSize;
-
-            allocations++;
-
-            return loop->region;
-            
-       }
-    //    mtx.unlock();
-    }
-
-   
-    /**
-     * Marks one of the items in the arena as freed. Returns true if this arena
-     * has no more allocation slots and everything is free'd.
-     */
-    bool free() {
-        // TODO: actually free an item the arena.
-        // mtx.lock();
-        Arena *nextptr = nullptr, *last = this;
-        if((nextptr != nullptr)){
-            nextptr = last->nextArena;
-            ::free(last->region);
-            ::free(last);
-            last = nextptr;
-        }
-        
-        allocations--;
-        if(allocations == 0)
-        {
-            return true;
+        if (m_freeList != nullptr) {
+            FreeSlot* slot = m_freeList;
+            m_freeList = slot->next;
+            m_allocated++;
+
+            return slot;
         }
-        return false;
-        // mtx.unlock();
+
+        if (m_allocated == m_capacity) {
+            return nullptr;
+        }
+
+        void* slot = m_next;
+        m_next += arenaSize();
+        m_allocated++;
+
+        return slot;
+    }
+
+    /**
+     * Returns the item at ptr to the arena. Returns true if everything in the
+     * arena is now free'd.
+     */
+    bool free(void* ptr) {
+        FreeSlot* slot = reinterpret_cast<FreeSlot*>(ptr);
+        slot->next = m_freeList;
+        m_freeList = slot;
+        m_allocated--;
+
+        return m_allocated == 0;
     }
 
     /**
      * Whether or not this arena can hold more items.
      */
     bool full() {
-        // TODO: acutally compute full()
-        // mtx.lock();
-        return allocations == expectedAllocations;
-        // mtx.unlock();
+        return m_allocated == m_capacity;
+    }
+
+    /**
+     * Whether every item in this arena is free.
+     */
+    bool empty() {
+        return m_allocated == 0;
     }
 
     /**
-     * Returns a pointer to the next free item in the arena.
+     * Returns a pointer to the next free item in the arena, or nullptr if full.
      */
     char* next() {
-        // mtx.lock();
-        m_next = reinterpret_cast<char*>(this) + sizeof(Arena);
-        return m_next;
-        // mtx.unlock();
+        if (m_freeList != nullptr) {
+            return reinterpret_cast<char*>(m_freeList);
+        }
+
+        return full() ? nullptr : m_next;
     }
 };
 
-class ArenaStore {
+/**
+ * The medium tier: allocations too big for an arena but no bigger than
+ * MediumSizeClasses::maxSize. They are carved out of ChunkSize chunks, each a
+ * single mapping aligned to its size. A chunk is split into pages, handed out
+ * in runs by a bitmap, and each run is a slab of page-aligned items of one
+ * medium class.
+ *
+ * Items carry no header. The chunk header records the slabs and which slab
+ * every page belongs to, and free() finds the chunk by masking the pointer.
+ * Live chunks are also listed in a direct-mapped table, which is how free()
+ * tells a medium pointer from an arena or BigAlloc one without reading memory
+ * that may not be a header.
+ *
+ * One LockPolicy lock covers the whole tier; a medium allocation costs a lock
+ * and a few bitmap or list operations, against a syscall for a BigAlloc.
+ */
+template <typename LockPolicy, size_t ChunkSize = 4 * 1024 * 1024> class MediumSlabs {
+    static_assert(ChunkSize >= 4 * MediumSizeClasses::maxSize && (ChunkSize & (ChunkSize - 1)) == 0,
+        "ChunkSize must be a power of two with room for the largest slabs");
+
+    using Classes = MediumSizeClasses;
+    using ChunkPages = AnonymousPages<ChunkSize>;
+
+    static constexpr size_t numClasses = Classes::numClasses;
+    static constexpr size_t pagesPerChunk = ChunkSize / pageSize;
+    static constexpr size_t chunkShift = __builtin_ctzll(ChunkSize);
+    static constexpr size_t tableSize = 1024;
+    static constexpr size_t noRun = SIZE_MAX;
+
+    /**
+     * Slabs hold 64 KiB of items, and at least 4 of them.
+     */
+    static constexpr size_t itemsPerSlab(size_t cls) {
+        size_t items = 64 * 1024 / Classes::sizeOf(cls);
+
+        return items > 4 ? items : 4;
+    }
+
+    static constexpr size_t slabPages(size_t cls) {
+        return itemsPerSlab(cls) * Classes::pagesOf(cls);
+    }
+
+    static constexpr size_t minSlabPages() {
+        size_t pages = slabPages(0);
+
+        for (size_t cls = 1; cls < numClasses; cls++) {
+            pages = slabPages(cls) < pages ? slabPages(cls) : pages;
+        }
+
+        return pages;
+    }
+
+    // Enough slab records for a chunk filled with the smallest slabs.
+    static constexpr size_t maxSlabs = pagesPerChunk / minSlabPages();
+
+    static_assert(maxSlabs <= 256, "Slab indices must fit in a byte");
+    static_assert(itemsPerSlab(0) <= 64, "walk() tracks a slab's free items in a word");
+
+    struct FreeItem {
+        FreeItem* next;
+    };
+
+    struct Slab {
+        // Links in the list of slabs of the class with free items.
+        Slab* prev;
+        Slab* next;
+
+        FreeItem* freeList;
+
+        // The next never-used item, bumped like Arena::m_next.
+        char* bump;
+
+        uint32_t capacity;
+        uint32_t allocated;
+
+        // A record with no pages is unused.
+        uint16_t firstPage;
+        uint16_t pages;
+        uint8_t cls;
+    };
+
+    struct Chunk : public MMapObject {
+        Chunk* prev;
+        Chunk* next;
+        size_t slabCount;
+
+        // A set bit is a page in use by the header or a slab.
+        uint64_t used[pagesPerChunk / 64];
+
+        // For each page in a slab, the index of its record in slabs.
+        uint8_t slabOf[pagesPerChunk];
+
+        Slab slabs[maxSlabs];
+    };
+
+    static constexpr size_t headerPages = (sizeof(Chunk) + pageSize - 1) / pageSize;
+
+    static_assert(headerPages + slabPages(numClasses - 1) <= pagesPerChunk,
+        "A fresh chunk must fit the largest slab");
+
+    LockPolicy m_lock;
+
+    // Per class, the slabs that still have free items.
+    Slab* m_partial[numClasses] = {};
+
+    Chunk* m_chunks = nullptr;
+
+    // Chunk bases, indexed by their chunk number modulo tableSize. A chunk
+    // that would collide with another is never used.
+    std::atomic<Chunk*> m_table[tableSize] = {};
+
+    static size_t slotOf(const void* ptr) {
+        return (reinterpret_cast<uintptr_t>(ptr) >> chunkShift) & (tableSize - 1);
+    }
+
+    static Chunk* chunkOf(const void* ptr) {
+        return reinterpret_cast<Chunk*>(reinterpret_cast<uintptr_t>(ptr) & ~(ChunkSize - 1));
+    }
+
+    static Slab* slabOf(Chunk* chunk, const void* ptr) {
+        size_t page = (static_cast<const char*>(ptr) - reinterpret_cast<char*>(chunk)) / pageSize;
+
+        return &chunk->slabs[chunk->slabOf[page]];
+    }
+
+    static void setBits(uint64_t* bits, size_t first, size_t count, bool value) {
+        for (size_t i = first; i < first + count; i++) {
+            uint64_t mask = uint64_t(1) << (i % 64);
+            bits[i / 64] = value ? bits[i / 64] | mask : bits[i / 64] & ~mask;
+        }
+    }
+
+    /**
+     * First fit: the lowest run of `pages` free pages in the chunk.
+     */
+    static size_t findRun(Chunk* chunk, size_t pages) {
+        size_t run = 0;
+        size_t page = 0;
+
+        while (page < pagesPerChunk) {
+            if (run == 0 && page % 64 == 0 && chunk->used[page / 64] == ~uint64_t(0)) {
+                page += 64;
+                continue;
+            }
+
+            if (chunk->used[page / 64] >> (page % 64) & 1) {
+                run = 0;
+            } else if (++run == pages) {
+                return page + 1 - pages;
+            }
+
+            page++;
+        }
+
+        return noRun;
+    }
+
+    void link(Slab* slab) {
+        slab->prev = nullptr;
+        slab->next = m_partial[slab->cls];
+
+        if (slab->next != nullptr) {
+            slab->next->prev = slab;
+        }
+
+        m_partial[slab->cls] = slab;
+    }
+
+    void unlink(Slab* slab) {
+        if (slab->prev != nullptr) {
+            slab->prev->next = slab->next;
+        } else {
+            m_partial[slab->cls] = slab->next;
+        }
+
+        if (slab->next != nullptr) {
+            slab->next->prev = slab->prev;
+        }
+
+        slab->prev = nullptr;
+        slab->next = nullptr;
+    }
+
+    /**
+     * Maps a chunk and lists it. Returns nullptr if no chunk could be mapped
+     * whose table slot is free.
+     */
+    Chunk* createChunk() {
+        Chunk* rejected[4];
+        size_t numRejected = 0;
+        Chunk* chunk = nullptr;
+
+        while (numRejected < 4) {
+            chunk = static_cast<Chunk*>(MMapObject::alloc<ChunkPages>(ChunkSize, 0));
+
+            if (chunk == nullptr || m_table[slotOf(chunk)].load(std::memory_order_relaxed) == nullptr) {
+                break;
+            }
+
+            // Holding on to it makes the next mapping land somewhere else.
+            rejected[numRejected++] = chunk;
+            chunk = nullptr;
+        }
+
+        for (size_t i = 0; i < numRejected; i++) {
+            MMapObject::dealloc<ChunkPages>(rejected[i]);
+        }
+
+        if (chunk == nullptr) {
+            return nullptr;
+        }
+
+        // A fresh anonymous mapping, so the rest of the header is zeroed.
+        setBits(chunk->used, 0, headerPages, true);
+
+        chunk->prev = nullptr;
+        chunk->next = m_chunks;
+
+        if (m_chunks != nullptr) {
+            m_chunks->prev = chunk;
+        }
+
+        m_chunks = chunk;
+        m_table[slotOf(chunk)].store(chunk, std::memory_order_release);
+
+        return chunk;
+    }
+
+    void releaseChunk(Chunk* chunk) {
+        if (chunk->prev != nullptr) {
+            chunk->prev->next = chunk->next;
+        } else {
+            m_chunks = chunk->next;
+        }
+
+        if (chunk->next != nullptr) {
+            chunk->next->prev = chunk->prev;
+        }
+
+        m_table[slotOf(chunk)].store(nullptr, std::memory_order_relaxed);
+        MMapObject::dealloc<ChunkPages>(chunk);
+    }
+
+    /**
+     * Carves a slab of the class out of the first chunk with room, mapping a
+     * new chunk if none has any. The lock must be held.
+     */
+    Slab* createSlab(size_t cls) {
+        size_t pages = slabPages(cls);
+        Chunk* chunk = m_chunks;
+        size_t first = noRun;
+
+        while (chunk != nullptr) {
+            if (chunk->slabCount < maxSlabs && (first = findRun(chunk, pages)) != noRun) {
+                break;
+            }
+
+            chunk = chunk->next;
+        }
+
+        if (chunk == nullptr) {
+            chunk = createChunk();
+
+            if (chunk == nullptr) {
+                return nullptr;
+            }
+
+            first = findRun(chunk, pages);
+        }
+
+        size_t index = 0;
+
+        while (chunk->slabs[index].pages != 0) {
+            index++;
+        }
+
+        Slab* slab = &chunk->slabs[index];
+        slab->freeList = nullptr;
+        slab->bump = reinterpret_cast<char*>(chunk) + first * pageSize;
+        slab->capacity = static_cast<uint32_t>(itemsPerSlab(cls));
+        slab->allocated = 0;
+        slab->firstPage = static_cast<uint16_t>(first);
+        slab->pages = static_cast<uint16_t>(pages);
+        slab->cls = static_cast<uint8_t>(cls);
+
+        setBits(chunk->used, first, pages, true);
+        memset(chunk->slabOf + first, static_cast<int>(index), pages);
+        chunk->slabCount++;
+        link(slab);
+
+        return slab;
+    }
+
     /**
-     * A set of arenas with the following sizes:
-     * 0: 8 bytes
-     * 1: 16 bytes
-     * 2: 32 bytes
-     * ...
-     * 8: 1024 bytes
+     * Gives an empty slab's pages back to its chunk, and unmaps the chunk if
+     * that leaves it empty and `keepLastChunk` doesn't apply. The lock must
+     * be held.
      */
-    Arena* m_arenas[9]; // Default initializer for pointer is nullptr
+    void releaseSlab(Slab* slab, bool keepLastChunk) {
+        Chunk* chunk = chunkOf(slab);
+
+        unlink(slab);
+        setBits(chunk->used, slab->firstPage, slab->pages, false);
+        slab->pages = 0;
+        chunk->slabCount--;
+
+        bool last = chunk->prev == nullptr && chunk->next == nullptr;
+
+        if (chunk->slabCount == 0 && !(keepLastChunk && last)) {
+            releaseChunk(chunk);
+        }
+    }
 
 public:
+    constexpr MediumSlabs() = default;
+    MediumSlabs(const MediumSlabs& other) = delete;
+
     /**
-     * Allocates `bytes` bytes of data. If the data is too large to fit in an arena,
-     * it will be allocated using BigAlloc.
+     * Unmaps every chunk left empty. Chunks with live items stay mapped, like
+     * arenas do.
+     */
+    ~MediumSlabs() {
+        trim();
+    }
+
+    /**
+     * Allocates an item of at least `bytes` bytes, page aligned. Returns
+     * nullptr if no chunk could be mapped.
      */
     void* alloc(size_t bytes) {
-        // TODO: implement alloc
-        if(bytes > 2048)
-        {
-            void *alloc = BigAlloc::alloc(bytes);
-            return alloc;
+        size_t cls = Classes::classOf(bytes);
+        std::lock_guard<LockPolicy> guard(m_lock);
+
+        Slab* slab = m_partial[cls];
+
+        if (slab == nullptr && (slab = createSlab(cls)) == nullptr) {
+            return nullptr;
         }
-        else
-        {
-            Arena *alloc = Arena::create(bytes);
-            switch(bytes)
-            {
-                case 8:
-                 m_arenas[0] = alloc;
-                case 16:
-                 m_arenas[1] = alloc;
-                case 32:
-                 m_arenas[2] = alloc;
-                case 64:
-                 m_arenas[3] = alloc;
-                case 128:
-                 m_arenas[4] = alloc;
-                case 256:
-                 m_arenas[5] = alloc;
-                case 512:
-                 m_arenas[6] = alloc;
-                case 1024:
-                 m_arenas[7] = alloc;
-                case 2048:
-                 m_arenas[8] = alloc;
-
-            }
-            void *v = reinterpret_cast <void *>(alloc);
-            return v;
-        } 
+
+        void* ptr;
+
+        if (slab->freeList != nullptr) {
+            ptr = slab->freeList;
+            slab->freeList = slab->freeList->next;
+        } else {
+            ptr = slab->bump;
+            slab->bump += Classes::sizeOf(cls);
+        }
+
+        if (++slab->allocated == slab->capacity) {
+            unlink(slab);
+        }
+
+        return ptr;
     }
 
     /**
-     * Determines the allocation type for the given pointer and calls
-     * the appropriate free method.
+     * Frees an item. The last empty slab of a class, and the last empty chunk,
+     * are kept so a single buffer being allocated and freed in a loop doesn't
+     * keep redoing the bookkeeping.
      */
     void free(void* ptr) {
-        // TODO: implement free.
-        MMapObject *mmpaObj = reinterpret_cast <MMapObject *>(ptr);
-        MMapObject::dealloc(mmpaObj);
-        if(mmpaObj->arenaSize() != 0)
-        {
-            Arena *arena = reinterpret_cast <Arena *>(ptr);
-            arena->deallocate();
+        std::lock_guard<LockPolicy> guard(m_lock);
+
+        Slab* slab = slabOf(chunkOf(ptr), ptr);
+        bool wasFull = slab->allocated == slab->capacity;
+
+        FreeItem* item = static_cast<FreeItem*>(ptr);
+        item->next = slab->freeList;
+        slab->freeList = item;
+        slab->allocated--;
+
+        if (wasFull) {
+            link(slab);
+        }
+
+        bool last = slab->prev == nullptr && slab->next == nullptr;
+
+        if (slab->allocated == 0 && !last) {
+            releaseSlab(slab, true);
+        }
+    }
+
+    /**
+     * Whether ptr is a medium item. Safe to call with any pointer the store
+     * handed out.
+     */
+    bool owns(const void* ptr) const {
+        return m_table[slotOf(ptr)].load(std::memory_order_acquire) == chunkOf(ptr);
+    }
+
+    /**
+     * The size of the item at ptr.
+     */
+    size_t usableSize(const void* ptr) const {
+        return Classes::sizeOf(slabOf(chunkOf(ptr), ptr)->cls);
+    }
+
+    /**
+     * Releases every empty slab, then unmaps every empty chunk.
+     */
+    void trim() {
+        std::lock_guard<LockPolicy> guard(m_lock);
+
+        for (size_t cls = 0; cls < numClasses; cls++) {
+            Slab* slab = m_partial[cls];
+
+            while (slab != nullptr) {
+                Slab* next = slab->next;
+
+                if (slab->allocated == 0) {
+                    releaseSlab(slab, false);
+                }
+
+                slab = next;
+            }
+        }
+
+        Chunk* chunk = m_chunks;
+
+        while (chunk != nullptr) {
+            Chunk* next = chunk->next;
+
+            if (chunk->slabCount == 0) {
+                releaseChunk(chunk);
+            }
+
+            chunk = next;
+        }
+    }
+
+    /**
+     * Calls visit(object) for every live item, holding the lock throughout.
+     * Returns the number of chunks.
+     */
+    template <typename Visitor> size_t walk(Visitor& visit) {
+        std::lock_guard<LockPolicy> guard(m_lock);
+        size_t chunks = 0;
+
+        for (Chunk* chunk = m_chunks; chunk != nullptr; chunk = chunk->next) {
+            for (size_t index = 0; index < maxSlabs; index++) {
+                Slab& slab = chunk->slabs[index];
+
+                if (slab.pages == 0) {
+                    continue;
+                }
+
+                char* first = reinterpret_cast<char*>(chunk) + slab.firstPage * pageSize;
+                size_t size = Classes::sizeOf(slab.cls);
+                uint64_t freeItems = 0;
+
+                for (FreeItem* item = slab.freeList; item != nullptr; item = item->next) {
+                    freeItems |= uint64_t(1) << (reinterpret_cast<char*>(item) - first) / size;
+                }
+
+                for (size_t i = 0; first + i * size < slab.bump; i++) {
+                    if (!(freeItems >> i & 1)) {
+                        visit(HeapObject { first + i * size, size, HeapObject::Tier::Medium, slab.cls });
+                    }
+                }
+            }
+
+            chunks++;
         }
+
+        return chunks;
     }
 
+    // Held across fork() along with the store's class locks.
+    void lock() { m_lock.lock(); }
+    void unlock() { m_lock.unlock(); }
 };
 
-void* myMalloc(size_t n);
-void myFree(void* ptr);
+/**
+ * A set of arenas, one list per size class, then MediumSlabs for items up to
+ * MediumSizeClasses::maxSize, and BigAlloc for anything larger than that. All
+ * behaviour is fixed at compile time by the policy parameters; see
+ * AllocatorPolicies.hpp.
+ *
+ * With thread caches enabled, small allocations are served from the calling
+ * thread's cache. An empty cache refills with a batch popped off the class's
+ * lock-free central list, and only takes the class lock to carve a fresh batch
+ * out of the arenas when that list is empty too. A full cache flushes a batch
+ * back onto the central list.
+ */
+template <
+    typename SizeClassPolicy = PowerOfTwoSizeClasses,
+    typename LockPolicy = MutexLock,
+    typename PagePolicy = DefaultPages,
+    typename StatsPolicy = NoStats,
+    typename CachePolicy = DefaultThreadCaches,
+    typename CanaryPolicy = NoCanaries
+> class ArenaStore : private StatsPolicy {
+    static constexpr size_t numClasses = SizeClassPolicy::numClasses;
+
+    static_assert(SizeClassPolicy::maxSize + Arena::slotOffset(SizeClassPolicy::maxSize) <= PagePolicy::pageSize,
+        "The largest size class must fit in a single arena");
+    static_assert(CachePolicy::maxThreads <= maxThreadIndices,
+        "Not enough thread indices for the requested number of caches");
+
+    using Cache = ThreadCache<numClasses>;
+    using Bin = typename Cache::Bin;
+
+    /**
+     * Per size class, the arenas that still have free slots. Allocation takes
+     * from the head; full arenas are unlinked until something in them is freed.
+     */
+    Arena* m_arenas[numClasses] = {}; // Default initializer for pointer is nullptr
+
+    // Per size class, the full arenas. Only walk() needs them.
+    Arena* m_fullArenas[numClasses] = {};
+
+    // Per size class, the arenas with free slots that serve sampled
+    // allocations, kept apart so ordinary frees never look for a canary.
+    Arena* m_sampledArenas[numClasses] = {};
+
+    LockPolicy m_locks[numClasses];
+
+    // Batches of free slots flushed by thread caches, per size class.
+    TaggedBatchStack m_central[numClasses];
+    BatchPool<PagePolicy> m_batches;
+
+    MediumSlabs<LockPolicy> m_medium;
+
+    // Every live BigAlloc, so walk() can find them.
+    BigAlloc* m_bigAllocs = nullptr;
+    LockPolicy m_bigLock;
+
+    // Tags a sample of small allocations and quarantines them once freed.
+    CanaryPolicy m_canaries;
+
+    // Per thread index, that thread's cache. Mapped on first use.
+    std::atomic<Cache*> m_caches[CachePolicy::maxThreads > 0 ? CachePolicy::maxThreads : 1] = {};
+
+    // Set by releaseMemory() for a single-threaded store to trim itself.
+    std::atomic<bool> m_trimRequested{false};
+
+    // Registered the first time the store takes a lock or maps a cache.
+    LifecycleHooks m_lifecycle = {
+        lockForFork, unlockAfterFork, resetInChild, drainExitingThread, releaseMemory, this,
+        LifecycleHooks::StoreTier, nullptr, {false}
+    };
+
+    /**
+     * Makes sure the store, and its page policy, are covered by the fork and
+     * thread exit hooks. Must be called before taking any class lock.
+     */
+    void ensureLifecycle() {
+        if (!m_lifecycle.registered.load(std::memory_order_acquire)) {
+            PagePolicy::registerLifecycle();
+            registerLifecycleHooks(&m_lifecycle);
+        }
+    }
+
+    /**
+     * Holds every class lock across fork(), so neither process can see an
+     * arena list mid-update.
+     */
+    static void lockForFork(void* context) {
+        ArenaStore* store = static_cast<ArenaStore*>(context);
+
+        for (size_t cls = 0; cls < numClasses; cls++) {
+            store->m_locks[cls].lock();
+        }
+
+        store->m_medium.lock();
+        store->m_bigLock.lock();
+        store->m_canaries.lock();
+    }
+
+    static void unlockAfterFork(void* context) {
+        ArenaStore* store = static_cast<ArenaStore*>(context);
+
+        store->m_canaries.unlock();
+        store->m_bigLock.unlock();
+        store->m_medium.unlock();
+
+        for (size_t cls = numClasses; cls-- > 0;) {
+            store->m_locks[cls].unlock();
+        }
+    }
+
+    /**
+     * In the child, only the forking thread survives. Every other thread's
+     * cache may have been caught half way through an update, so rather than
+     * trust its contents the child abandons it; the slots it held stay
+     * allocated.
+     */
+    static void resetInChild(void* context, size_t survivingIndex) {
+        ArenaStore* store = static_cast<ArenaStore*>(context);
+
+        unlockAfterFork(context);
+
+        for (size_t index = 0; index < CachePolicy::maxThreads; index++) {
+            if (index != survivingIndex) {
+                store->m_caches[index].store(nullptr, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Runs on an exiting thread: everything the thread has cached goes back
+     * to the arenas, and arenas it leaves empty are released, so short-lived
+     * threads don't strand memory. The cache itself stays mapped, empty, for
+     * the next thread to get this index.
+     */
+    static void drainExitingThread(void* context, size_t index) {
+        ArenaStore* store = static_cast<ArenaStore*>(context);
+
+        if (index >= CachePolicy::maxThreads) {
+            return;
+        }
+
+        Cache* cache = store->m_caches[index].load(std::memory_order_relaxed);
+
+        if (cache == nullptr) {
+            return;
+        }
+
+        for (size_t cls = 0; cls < numClasses; cls++) {
+            ClassLock guard(*store, cls);
+            store->drainBin(cls, cache->bins[cls]);
+        }
+    }
+
+    /**
+     * Under memory pressure, from whichever thread felt it. A store whose
+     * locks don't keep other threads out belongs to one thread, so it is only
+     * asked to trim, and does so on its owner's next slow path.
+     */
+    static void releaseMemory(void* context) {
+        ArenaStore* store = static_cast<ArenaStore*>(context);
+
+        if constexpr (ExcludesThreads<LockPolicy>::value) {
+            store->trim();
+        } else {
+            store->m_trimRequested.store(true, std::memory_order_relaxed);
+        }
+    }
+
+    void trimIfRequested() {
+        if constexpr (!ExcludesThreads<LockPolicy>::value) {
+            if (m_trimRequested.exchange(false, std::memory_order_relaxed)) {
+                trim();
+            }
+        }
+    }
+
+    /**
+     * Runs the memory pressure hooks if crossing the soft cap asked for that.
+     * Called on slow paths before any lock is taken.
+     */
+    void relievePressure() {
+        if (MemoryLimits::takePurgeRequest()) {
+            runMemoryPressureHooks();
+        }
+
+        trimIfRequested();
+    }
+
+    /**
+     * After a failed mapping: if a hard cap may be what refused it, gives
+     * memory back and says a retry is worth it.
+     */
+    bool reclaimAfterFailure() {
+        if (MemoryLimits::hardLimit() == 0) {
+            return false;
+        }
+
+        runMemoryPressureHooks();
+        trimIfRequested();
+
+        return true;
+    }
+
+    /**
+     * How many slots of a class move between a cache and the central list at
+     * once: roughly half an arena's worth, capped by the batch capacity.
+     */
+    static constexpr size_t batchSize(size_t cls) {
+        size_t slots = PagePolicy::pageSize / SizeClassPolicy::sizeOf(cls) / 2;
+
+        if (slots < 1) {
+            return 1;
+        }
+
+        return slots < SlotBatch::maxSlots ? slots : SlotBatch::maxSlots;
+    }
+
+    /**
+     * Holds a class lock for its lifetime. An acquisition that finds the lock
+     * taken is reported to the stats policy, timed if it asks for that.
+     */
+    class ClassLock {
+        ArenaStore& m_store;
+        size_t m_cls;
+
+    public:
+        ClassLock(ArenaStore& store, size_t cls): m_store(store), m_cls(cls) {
+            store.ensureLifecycle();
+
+            LockPolicy& lock = store.m_locks[cls];
+
+            if (!lock.try_lock()) {
+                uint64_t start = now();
+                lock.lock();
+                store.onLockWait(cls, elapsedSince(start));
+            }
+        }
+
+        ~ClassLock() {
+            m_store.m_locks[m_cls].unlock();
+        }
+    };
+
+    // The clock is only read if the stats policy wants durations.
+    static uint64_t now() {
+        if constexpr (StatsPolicy::timed) {
+            return monotonicNanos();
+        } else {
+            return 0;
+        }
+    }
+
+    static uint64_t elapsedSince(uint64_t start) {
+        return StatsPolicy::timed ? now() - start : 0;
+    }
+
+    static void link(Arena*& list, Arena* arena) {
+        arena->m_prevArena = nullptr;
+        arena->m_nextArena = list;
+
+        if (list != nullptr) {
+            list->m_prevArena = arena;
+        }
+
+        list = arena;
+    }
+
+    static void unlink(Arena*& list, Arena* arena) {
+        if (arena->m_prevArena != nullptr) {
+            arena->m_prevArena->m_nextArena = arena->m_nextArena;
+        } else {
+            list = arena->m_nextArena;
+        }
+
+        if (arena->m_nextArena != nullptr) {
+            arena->m_nextArena->m_prevArena = arena->m_prevArena;
+        }
+
+        arena->m_prevArena = nullptr;
+        arena->m_nextArena = nullptr;
+    }
+
+    /**
+     * The list an arena with free slots belongs on.
+     */
+    Arena*& partialArenas(size_t cls, bool sampled) {
+        return sampled ? m_sampledArenas[cls] : m_arenas[cls];
+    }
+
+    void release(size_t cls, Arena* arena) {
+        unlink(partialArenas(cls, arena->m_sampled), arena);
+        MMapObject::dealloc<PagePolicy>(arena);
+        this->onArenaRelease(cls);
+    }
+
+    /**
+     * Maps a new, unlinked arena for the class. Returns nullptr if the pages
+     * couldn't be mapped.
+     */
+    Arena* createArena(size_t cls, bool sampled) {
+        uint64_t start = now();
+        Arena* arena = Arena::create<PagePolicy>(SizeClassPolicy::sizeOf(cls));
+
+        if (arena == nullptr) {
+            return nullptr;
+        }
+
+        arena->m_sizeClass = static_cast<uint32_t>(cls);
+        arena->m_sampled = sampled;
+        this->onArenaCreate(cls);
+        this->onSlowPath(SlowPath::ArenaCreate, elapsedSince(start));
+
+        return arena;
+    }
+
+    /**
+     * Takes a slot from the class's arenas, or its sampled ones, creating one
+     * if they're all full. The class lock must be held.
+     */
+    void* allocFromArenas(size_t cls, bool sampled = false) {
+        Arena*& list = partialArenas(cls, sampled);
+        Arena* arena = list;
+
+        if (arena == nullptr) {
+            if ((arena = createArena(cls, sampled)) == nullptr) {
+                return nullptr;
+            }
+
+            link(list, arena);
+        }
+
+        void* ptr = arena->alloc();
+
+        if (arena->full()) {
+            unlink(list, arena);
+            link(m_fullArenas[cls], arena);
+        }
+
+        return ptr;
+    }
+
+    void track(BigAlloc* big) {
+        ensureLifecycle();
+        std::lock_guard<LockPolicy> guard(m_bigLock);
+
+        big->m_next = m_bigAllocs;
+
+        if (m_bigAllocs != nullptr) {
+            m_bigAllocs->m_prev = big;
+        }
+
+        m_bigAllocs = big;
+    }
+
+    void untrack(BigAlloc* big) {
+        std::lock_guard<LockPolicy> guard(m_bigLock);
+
+        if (big->m_prev != nullptr) {
+            big->m_prev->m_next = big->m_next;
+        } else {
+            m_bigAllocs = big->m_next;
+        }
+
+        if (big->m_next != nullptr) {
+            big->m_next->m_prev = big->m_prev;
+        }
+    }
+
+    /**
+     * Calls visit(object) for the live items in every arena on the list,
+     * leaving out sampled slots in canary quarantine. The class lock must be
+     * held. Returns the number of arenas.
+     */
+    template <typename Visitor> size_t walkArenas(size_t cls, Arena* arena, Visitor& visit) {
+        constexpr size_t maxSlots = PagePolicy::pageSize / smallestSlot<SizeClassPolicy>();
+        size_t size = SizeClassPolicy::sizeOf(cls);
+        size_t arenas = 0;
+
+        for (; arena != nullptr; arena = arena->m_nextArena) {
+            char* first = reinterpret_cast<char*>(arena) + Arena::slotOffset(size);
+            uint64_t freeSlots[(maxSlots + 63) / 64] = {};
+
+            for (Arena::FreeSlot* slot = arena->m_freeList; slot != nullptr; slot = slot->next) {
+                size_t index = (reinterpret_cast<char*>(slot) - first) / size;
+                freeSlots[index / 64] |= uint64_t(1) << (index % 64);
+            }
+
+            for (size_t i = 0; first + i * size < arena->m_next; i++) {
+                if (freeSlots[i / 64] >> (i % 64) & 1) {
+                    continue;
+                }
+
+                if constexpr (CanaryPolicy::enabled) {
+                    if (arena->m_sampled && !m_canaries.live(first + i * size, size)) {
+                        continue;
+                    }
+                }
+
+                visit(HeapObject { first + i * size, size, HeapObject::Tier::Arena, cls });
+            }
+
+            arenas++;
+        }
+
+        return arenas;
+    }
+
+    /**
+     * Walks everything, adding up the arenas, medium chunks and BigAllocs
+     * passed in `containers`.
+     */
+    template <typename Visitor> void walkAll(Visitor& visit, size_t containers[3]) {
+        for (size_t cls = 0; cls < numClasses; cls++) {
+            ClassLock guard(*this, cls);
+            containers[0] += walkArenas(cls, m_arenas[cls], visit);
+            containers[0] += walkArenas(cls, m_fullArenas[cls], visit);
+            containers[0] += walkArenas(cls, m_sampledArenas[cls], visit);
+        }
+
+        containers[1] += m_medium.walk(visit);
+
+        std::lock_guard<LockPolicy> guard(m_bigLock);
+
+        for (BigAlloc* big = m_bigAllocs; big != nullptr; big = big->m_next) {
+            visit(HeapObject { big->m_data, big->mmapSize() - sizeof(BigAlloc), HeapObject::Tier::Big, 0 });
+            containers[2]++;
+        }
+    }
+
+    /**
+     * allocFromArenas() under the class lock.
+     */
+    void* lockedAlloc(size_t cls) {
+        ClassLock guard(*this, cls);
+        return allocFromArenas(cls);
+    }
+
+    /**
+     * Gives ptr back to the arena it came from. The class lock must be held.
+     */
+    void freeToArena(size_t cls, void* ptr) {
+        Arena* arena = static_cast<Arena*>(MMapObject::owner<PagePolicy>(ptr));
+
+        bool wasFull = arena->full();
+        bool empty = arena->free(ptr);
+
+        if (wasFull) {
+            unlink(m_fullArenas[cls], arena);
+            link(partialArenas(cls, arena->m_sampled), arena);
+        }
+
+        // Hold on to the last arena of each class so alloc/free ping-pong
+        // doesn't map and unmap a page every time. A single-slot arena is no
+        // cheaper to keep around than a BigAlloc, so those always go.
+        bool last = arena->m_prevArena == nullptr && arena->m_nextArena == nullptr;
+
+        if (empty && (!last || arena->m_capacity == 1)) {
+            release(cls, arena);
+        }
+    }
+
+    /**
+     * Unmaps every empty arena of the class. The class lock must be held.
+     */
+    void releaseEmptyArenas(size_t cls) {
+        for (Arena* arena : {m_arenas[cls], m_sampledArenas[cls]}) {
+            while (arena != nullptr) {
+                Arena* next = arena->m_nextArena;
+
+                if (arena->empty()) {
+                    release(cls, arena);
+                }
+
+                arena = next;
+            }
+        }
+    }
+
+    /**
+     * Returns everything in bin to the arenas. The class lock must be held.
+     */
+    void drainBin(size_t cls, Bin& bin) {
+        for (size_t i = 0; i < bin.count; i++) {
+            freeToArena(cls, bin.slots[i]);
+        }
+
+        bin.count = 0;
+    }
+
+    /**
+     * Pops batches off the class's central list until at most `keep` remain,
+     * returning their slots to the arenas. The class lock must be held.
+     */
+    void drainCentral(size_t cls, size_t keep) {
+        while (m_central[cls].size() > keep) {
+            SlotBatch* batch = m_central[cls].pop(m_batches);
+
+            if (batch == nullptr) {
+                break;
+            }
+
+            for (size_t i = 0; i < batch->count; i++) {
+                freeToArena(cls, batch->slots[i]);
+            }
+
+            m_batches.release(batch);
+        }
+    }
+
+    /**
+     * The calling thread's cache, or nullptr if it doesn't get one.
+     */
+    Cache* threadCache() {
+        size_t index = threadIndex();
+
+        if (index >= CachePolicy::maxThreads) {
+            return nullptr;
+        }
+
+        // Only the owning thread reads or writes its slot; handing an index to
+        // a new thread is ordered by the thread index registry.
+        Cache* cache = m_caches[index].load(std::memory_order_relaxed);
+
+        if (cache == nullptr) {
+            ensureLifecycle();
+            cache = static_cast<Cache*>(CountedPages::map<PagePolicy>(sizeof(Cache)));
+
+            if (cache == nullptr) {
+                return nullptr;
+            }
+
+            memset(cache, 0, sizeof(Cache));
+            m_caches[index].store(cache, std::memory_order_relaxed);
+        }
+
+        return cache;
+    }
+
+    /**
+     * Fills an empty bin from the central list, or from the arenas if the
+     * central list has nothing. Returns false if no memory could be had.
+     */
+    bool refill(size_t cls, Bin& bin) {
+        if (SlotBatch* batch = m_central[cls].pop(m_batches)) {
+            memcpy(bin.slots, batch->slots, batch->count * sizeof(void*));
+            bin.count = batch->count;
+            m_batches.release(batch);
+
+            return true;
+        }
+
+        uint64_t start = now();
+        relievePressure();
+
+        {
+            ClassLock guard(*this, cls);
+
+            for (size_t i = 0; i < batchSize(cls); i++) {
+                void* ptr = allocFromArenas(cls);
+
+                if (ptr == nullptr) {
+                    break;
+                }
+
+                bin.slots[bin.count++] = ptr;
+            }
+        }
+
+        this->onSlowPath(SlowPath::LockedRefill, elapsedSince(start));
+
+        return bin.count > 0;
+    }
+
+    /**
+     * Moves the oldest batch of a full bin onto the central list. If that
+     * list has grown past its limit and the class lock is free, the excess
+     * goes back to the arenas; otherwise that is left for a later flush.
+     */
+    void flush(size_t cls, Bin& bin) {
+        size_t count = batchSize(cls);
+        SlotBatch* batch = m_batches.acquire();
+
+        if (batch != nullptr) {
+            memcpy(batch->slots, bin.slots, count * sizeof(void*));
+            batch->count = count;
+            m_central[cls].push(batch);
+        } else {
+            uint64_t start = now();
+
+            {
+                ClassLock guard(*this, cls);
+
+                for (size_t i = 0; i < count; i++) {
+                    freeToArena(cls, bin.slots[i]);
+                }
+            }
+
+            this->onSlowPath(SlowPath::LockedFlush, elapsedSince(start));
+        }
+
+        memmove(bin.slots, bin.slots + count, (bin.count - count) * sizeof(void*));
+        bin.count -= count;
+
+        if (m_central[cls].size() > CachePolicy::centralBatches && m_locks[cls].try_lock()) {
+            drainCentral(cls, CachePolicy::centralBatches / 2);
+            m_locks[cls].unlock();
+        }
+    }
+
+    /**
+     * Allocates a slot of the given class, from the calling thread's cache if
+     * it has one.
+     */
+    void* allocSlot(size_t cls) {
+        if constexpr (CachePolicy::enabled) {
+            if (Cache* cache = threadCache()) {
+                Bin& bin = cache->bins[cls];
+
+                if (bin.count == 0) {
+                    uint64_t start = now();
+
+                    if (!refill(cls, bin) && !(reclaimAfterFailure() && refill(cls, bin))) {
+                        return nullptr;
+                    }
+
+                    this->onSlowPath(SlowPath::Refill, elapsedSince(start));
+                }
+
+                this->onAlloc(cls);
+
+                return bin.slots[--bin.count];
+            }
+        }
+
+        relievePressure();
+
+        uint64_t start = now();
+        void* ptr = lockedAlloc(cls);
+
+        if (ptr == nullptr && reclaimAfterFailure()) {
+            ptr = lockedAlloc(cls);
+        }
+
+        if (ptr != nullptr) {
+            this->onAlloc(cls);
+            this->onSlowPath(SlowPath::LockedAlloc, elapsedSince(start));
+        }
+
+        return ptr;
+    }
+
+    /**
+     * Allocates `bytes` bytes from a slot of a sampled arena with room for a
+     * canary after them, and tags it.
+     */
+    void* allocSampled(size_t bytes) {
+        size_t cls = SizeClassPolicy::classOf(bytes + CanaryPolicy::trailerSize);
+
+        relievePressure();
+
+        uint64_t start = now();
+        ClassLock guard(*this, cls);
+        void* ptr = allocFromArenas(cls, true);
+
+        if (ptr != nullptr) {
+            m_canaries.arm(ptr, SizeClassPolicy::sizeOf(cls));
+            this->onAlloc(cls);
+            this->onSlowPath(SlowPath::LockedAlloc, elapsedSince(start));
+        }
+
+        return ptr;
+    }
+
+    /**
+     * Frees a slot of a sampled arena into canary quarantine, and whatever
+     * that pushes out back to its arena.
+     */
+    void freeSampled(Arena* arena, void* ptr) {
+        this->onFree(arena->m_sizeClass);
+
+        if (void* evicted = m_canaries.retire(ptr, arena->arenaSize())) {
+            freeEvicted(evicted);
+        }
+    }
+
+    void freeEvicted(void* slot) {
+        size_t cls = static_cast<Arena*>(MMapObject::owner<PagePolicy>(slot))->m_sizeClass;
+
+        uint64_t start = now();
+        ClassLock guard(*this, cls);
+        freeToArena(cls, slot);
+        this->onSlowPath(SlowPath::LockedFree, elapsedSince(start));
+    }
+
+    /**
+     * Whether ptr points into one of the store's BigAllocs. Past the first
+     * arena-sized block of one, MMapObject::owner() lands in the middle of
+     * the allocation, not on a header.
+     */
+    bool insideBigAlloc(const void* ptr) {
+        std::lock_guard<LockPolicy> guard(m_bigLock);
+
+        for (BigAlloc* big = m_bigAllocs; big != nullptr; big = big->m_next) {
+            const char* start = reinterpret_cast<const char*>(big);
+
+            if (ptr >= start && ptr < start + big->mmapSize()) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * The start of the slot ptr points into, or nullptr if ptr isn't in a
+     * sampled arena.
+     */
+    void* sampledSlot(void* ptr) {
+        if (m_medium.owns(ptr) || insideBigAlloc(ptr)) {
+            return nullptr;
+        }
+
+        MMapObject* obj = MMapObject::owner<PagePolicy>(ptr);
+        size_t size = obj->arenaSize();
+
+        if (size == 0 || !static_cast<Arena*>(obj)->m_sampled) {
+            return nullptr;
+        }
+
+        char* first = reinterpret_cast<char*>(obj) + Arena::slotOffset(size);
+        char* at = static_cast<char*>(ptr);
+
+        return at < first ? nullptr : first + (at - first) / size * size;
+    }
+
+    /**
+     * Really frees every slot sitting in canary quarantine.
+     */
+    void releaseQuarantine() {
+        if constexpr (CanaryPolicy::enabled) {
+            while (void* slot = m_canaries.evict()) {
+                freeEvicted(slot);
+            }
+        }
+    }
+
+public:
+    using Stats = StatsPolicy;
+
+    // Keep this constexpr: a static store is then constant-initialized, costs
+    // nothing at startup, and maps its arenas, caches and page ranges on first
+    // use. The size class tables are constant expressions too.
+    constexpr ArenaStore() = default;
+    ArenaStore(const ArenaStore& other) = delete;
+
+    /**
+     * Returns every thread's cached slots, then unmaps the arenas that are
+     * empty. Arenas that still hold live items are left alone, so late frees
+     * into them stay valid. No other thread may be using the store.
+     */
+    ~ArenaStore() {
+        releaseQuarantine();
+
+        for (size_t index = 0; index < CachePolicy::maxThreads; index++) {
+            Cache* cache = m_caches[index].load();
+
+            if (cache == nullptr) {
+                continue;
+            }
+
+            for (size_t cls = 0; cls < numClasses; cls++) {
+                ClassLock guard(*this, cls);
+                drainBin(cls, cache->bins[cls]);
+            }
+
+            CountedPages::unmap<PagePolicy>(cache, sizeof(Cache));
+            m_caches[index].store(nullptr);
+        }
+
+        for (size_t cls = 0; cls < numClasses; cls++) {
+            ClassLock guard(*this, cls);
+            drainCentral(cls, 0);
+            releaseEmptyArenas(cls);
+        }
+
+        // Last, since taking the class locks above registers the hooks.
+        unregisterLifecycleHooks(&m_lifecycle);
+    }
+
+    /**
+     * Allocates `bytes` bytes of data. If the data is too large to fit in an arena,
+     * it goes to the medium tier, or to BigAlloc if it's too large for that.
+     */
+    void* alloc(size_t bytes) {
+        if (bytes > SizeClassPolicy::maxSize) {
+            relievePressure();
+
+            if (bytes <= MediumSizeClasses::maxSize) {
+                ensureLifecycle();
+
+                uint64_t start = now();
+                void* ptr = m_medium.alloc(bytes);
+
+                if (ptr == nullptr && reclaimAfterFailure()) {
+                    ptr = m_medium.alloc(bytes);
+                }
+
+                if (ptr != nullptr) {
+                    this->onSlowPath(SlowPath::MediumAlloc, elapsedSince(start));
+                    return ptr;
+                }
+
+                // No chunk to be had; a mapping of its own may still work.
+            }
+
+            uint64_t start = now();
+            void* ptr = BigAlloc::alloc<PagePolicy>(bytes);
+
+            if (ptr == nullptr && reclaimAfterFailure()) {
+                ptr = BigAlloc::alloc<PagePolicy>(bytes);
+            }
+
+            if (ptr != nullptr) {
+                track(reinterpret_cast<BigAlloc*>(static_cast<char*>(ptr) - sizeof(BigAlloc)));
+                this->onBigAlloc(bytes + sizeof(BigAlloc));
+                this->onSlowPath(SlowPath::BigAlloc, elapsedSince(start));
+            }
+
+            return ptr;
+        }
+
+        if constexpr (CanaryPolicy::enabled) {
+            if (bytes + CanaryPolicy::trailerSize <= SizeClassPolicy::maxSize && m_canaries.sample()) {
+                return allocSampled(bytes);
+            }
+        }
+
+        return allocSlot(SizeClassPolicy::classOf(bytes));
+    }
+
+    /**
+     * Allocates `bytes` bytes aligned to `alignment`, a power of two of at most
+     * maxAlignment; returns nullptr for anything larger. Slots are aligned to
+     * their size, so this only picks a class big enough to be aligned right.
+     * The result is freed with free() like any other.
+     */
+    void* alloc(size_t bytes, size_t alignment) {
+        if (alignment <= ALIGNMENT) {
+            return alloc(bytes);
+        }
+
+        if (alignment > maxAlignment || (alignment & (alignment - 1)) != 0) {
+            return nullptr;
+        }
+
+        bytes = bytes > alignment ? bytes : alignment;
+
+        if (bytes <= SizeClassPolicy::maxSize) {
+            for (size_t cls = SizeClassPolicy::classOf(bytes); cls < numClasses; cls++) {
+                size_t size = SizeClassPolicy::sizeOf(cls);
+
+                if ((size & (alignment - 1)) == 0) {
+                    return allocSlot(cls);
+                }
+            }
+
+            // Medium items are page aligned.
+            bytes = SizeClassPolicy::maxSize + 1;
+        }
+
+        return alloc(bytes);
+    }
+
+    /**
+     * Determines the allocation type for the given pointer and calls
+     * the appropriate free method.
+     */
+    void free(void* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+
+        if (m_medium.owns(ptr)) {
+            uint64_t start = now();
+            m_medium.free(ptr);
+            this->onSlowPath(SlowPath::MediumFree, elapsedSince(start));
+
+            return;
+        }
+
+        MMapObject* obj = MMapObject::owner<PagePolicy>(ptr);
+
+        if (obj->arenaSize() == 0) {
+            uint64_t start = now();
+            this->onBigFree(obj->mmapSize());
+            untrack(static_cast<BigAlloc*>(obj));
+            MMapObject::dealloc<PagePolicy>(obj);
+            this->onSlowPath(SlowPath::BigFree, elapsedSince(start));
+
+            return;
+        }
+
+        Arena* arena = static_cast<Arena*>(obj);
+
+        if constexpr (CanaryPolicy::enabled) {
+            if (arena->m_sampled) {
+                freeSampled(arena, ptr);
+                return;
+            }
+        }
+
+        size_t cls = arena->m_sizeClass;
+        this->onFree(cls);
+
+        if constexpr (CachePolicy::enabled) {
+            if (Cache* cache = threadCache()) {
+                Bin& bin = cache->bins[cls];
+
+                if (bin.count == 2 * batchSize(cls)) {
+                    uint64_t start = now();
+                    flush(cls, bin);
+                    this->onSlowPath(SlowPath::Flush, elapsedSince(start));
+                }
+
+                bin.slots[bin.count++] = ptr;
+
+                return;
+            }
+        }
+
+        uint64_t start = now();
+        ClassLock guard(*this, cls);
+        freeToArena(cls, ptr);
+        this->onSlowPath(SlowPath::LockedFree, elapsedSince(start));
+    }
+
+    /**
+     * Fills the warm pool: tops every size class up to arenasPerClass arenas
+     * with free slots and maps the calling thread's cache, on pages the page
+     * policy faults in up front (see prewarm()). A short-lived process can call
+     * it at startup so the first allocation of each class skips both the
+     * mapping and the page faults. trim() hands the pool back. Returns false
+     * if the arenas couldn't all be mapped.
+     */
+    bool warm(size_t arenasPerClass) {
+        size_t missing[numClasses] = {};
+        size_t pages = 0;
+
+        for (size_t cls = 0; cls < numClasses; cls++) {
+            ClassLock guard(*this, cls);
+            missing[cls] = arenasPerClass;
+
+            for (Arena* arena = m_arenas[cls]; arena != nullptr && missing[cls] > 0; arena = arena->m_nextArena) {
+                missing[cls]--;
+            }
+
+            pages += missing[cls];
+        }
+
+        size_t cacheBytes = 0;
+
+        if constexpr (CachePolicy::enabled) {
+            size_t index = threadIndex();
+
+            if (index < CachePolicy::maxThreads && m_caches[index].load(std::memory_order_relaxed) == nullptr) {
+                cacheBytes = PagePolicy::roundUp(sizeof(Cache));
+            }
+        }
+
+        PagePolicy::prewarm(pages * PagePolicy::pageSize + cacheBytes);
+
+        if constexpr (CachePolicy::enabled) {
+            threadCache();
+        }
+
+        for (size_t cls = 0; cls < numClasses; cls++) {
+            ClassLock guard(*this, cls);
+
+            for (; missing[cls] > 0; missing[cls]--) {
+                Arena* arena = createArena(cls, false);
+
+                if (arena == nullptr) {
+                    return false;
+                }
+
+                link(m_arenas[cls], arena);
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Returns the calling thread's cached slots and everything parked on the
+     * central free lists to the arenas, then unmaps every arena and medium chunk
+     * left empty. Other threads' caches are untouched.
+     */
+    void trim() {
+        releaseQuarantine();
+
+        Cache* cache = nullptr;
+
+        if constexpr (CachePolicy::enabled) {
+            size_t index = threadIndex();
+
+            if (index < CachePolicy::maxThreads) {
+                cache = m_caches[index].load(std::memory_order_relaxed);
+            }
+        }
+
+        for (size_t cls = 0; cls < numClasses; cls++) {
+            ClassLock guard(*this, cls);
+
+            if (cache != nullptr) {
+                drainBin(cls, cache->bins[cls]);
+            }
+
+            drainCentral(cls, 0);
+            releaseEmptyArenas(cls);
+        }
+
+        m_medium.trim();
+    }
+
+    /**
+     * The usable size of the allocation at ptr, which may be larger than what
+     * was asked for.
+     */
+    size_t usableSize(void* ptr) {
+        if (m_medium.owns(ptr)) {
+            return m_medium.usableSize(ptr);
+        }
+
+        MMapObject* obj = MMapObject::owner<PagePolicy>(ptr);
+
+        if (obj->arenaSize() == 0) {
+            return obj->mmapSize() - sizeof(BigAlloc);
+        }
+
+        if constexpr (CanaryPolicy::enabled) {
+            if (static_cast<Arena*>(obj)->m_sampled) {
+                return obj->arenaSize() - CanaryPolicy::trailerSize;
+            }
+        }
+
+        return obj->arenaSize();
+    }
+
+    /**
+     * With canaries, checks that ptr isn't into a sampled slot that has been
+     * freed. ptr may point anywhere into an allocation from this store; the
+     * BigAllocs are searched, so it costs more the more of them there are. A
+     * hit is reported through CanaryReports and returns false. Anything
+     * unsampled, or without canaries at all, passes.
+     */
+    bool validate(void* ptr) {
+        if constexpr (CanaryPolicy::enabled) {
+            if (void* slot = sampledSlot(ptr)) {
+                return m_canaries.validate(slot, MMapObject::owner<PagePolicy>(slot)->arenaSize());
+            }
+        }
+
+        return true;
+    }
+
+    const CanaryPolicy& canaries() const {
+        return m_canaries;
+    }
+
+    /**
+     * Calls visit(const HeapObject&) for every live allocation, without
+     * stopping the world: each size class, the medium tier and the BigAllocs
+     * are walked in turn under their own lock, so allocations elsewhere carry
+     * on and the result is not one atomic snapshot. visit runs with that lock
+     * held and must not allocate or free through this store.
+     *
+     * Slots sitting in a thread cache or on a central free list are still
+     * allocated as far as their arena knows, and are reported as live. trim()
+     * first returns the calling thread's to the arenas.
+     */
+    template <typename Visitor> void walk(Visitor visit) {
+        size_t containers[3] = {};
+        walkAll(visit, containers);
+    }
+
+    /**
+     * Totals of everything walk() reports, bucketed by size class.
+     */
+    HeapSummary summary() {
+        static_assert(numClasses + MediumSizeClasses::numClasses + 1 <= HeapSummary::maxBuckets,
+            "Too many size classes for a HeapSummary");
+
+        HeapSummary summary = {};
+        size_t bucket = 0;
+
+        for (size_t cls = 0; cls < numClasses; cls++, bucket++) {
+            summary.buckets[bucket].from = cls == 0 ? 1 : SizeClassPolicy::sizeOf(cls - 1) + 1;
+            summary.buckets[bucket].to = SizeClassPolicy::sizeOf(cls);
+        }
+
+        for (size_t cls = 0; cls < MediumSizeClasses::numClasses; cls++, bucket++) {
+            summary.buckets[bucket].from = cls == 0
+                ? SizeClassPolicy::maxSize + 1
+                : MediumSizeClasses::sizeOf(cls - 1) + 1;
+            summary.buckets[bucket].to = MediumSizeClasses::sizeOf(cls);
+        }
+
+        summary.buckets[bucket].from = MediumSizeClasses::maxSize + 1;
+        summary.buckets[bucket].to = SIZE_MAX;
+        summary.numBuckets = bucket + 1;
+
+        auto count = [&](const HeapObject& object) {
+            size_t tier = static_cast<size_t>(object.tier);
+            size_t index = tier == 0 ? object.sizeClass
+                : tier == 1 ? numClasses + object.sizeClass
+                : summary.numBuckets - 1;
+
+            summary.buckets[index].count++;
+            summary.buckets[index].bytes += object.usableSize;
+            summary.objects[tier]++;
+            summary.bytes[tier] += object.usableSize;
+        };
+
+        size_t containers[3] = {};
+        walkAll(count, containers);
+
+        summary.arenas = containers[0];
+        summary.mediumChunks = containers[1];
+        summary.bigAllocs = containers[2];
+        summary.mappedBytes = MMapObject::mappedBytes();
+
+        return summary;
+    }
+
+    const StatsPolicy& stats() const {
+        return *this;
+    }
+};
+
+/**
+ * The store behind myMalloc and myFree. Building with -DARENA_LATENCY_STATS
+ * swaps in LatencyStats, so myMallocStats() can report slow-path latency.
+ * Building with -DARENA_CANARIES tags about one small allocation in a thousand
+ * (see SampledCanaries), so myFree and myMallocValidate catch a share of
+ * double frees and uses after free.
+ */
+#ifdef ARENA_LATENCY_STATS
+using DefaultStats = LatencyStats;
+#else
+using DefaultStats = NoStats;
+#endif
+
+#ifdef ARENA_CANARIES
+using DefaultCanaries = SampledCanaries<>;
+#else
+using DefaultCanaries = NoCanaries;
+#endif
+
+using DefaultArenaStore = ArenaStore<
+    PowerOfTwoSizeClasses, MutexLock, DefaultPages, DefaultStats, DefaultThreadCaches, DefaultCanaries
+>;
+
+void* myMalloc(size_t n);
+void myFree(void* ptr);
+
+/**
+ * Like aligned_alloc, for alignments up to maxAlignment. Returns nullptr for
+ * larger ones. Free the result with myFree.
+ */
+void* myMallocAligned(size_t alignment, size_t n);
+
+/**
+ * In a -DARENA_CANARIES build, returns false, after reporting it through
+ * CanaryReports, if ptr points into a sampled allocation that has been freed.
+ * Otherwise always true. Cheap enough to sprinkle over hot accessors.
+ */
+bool myMallocValidate(void* ptr);
+
+/**
+ * Prefaults arenasPerClass arenas per size class, and the calling thread's
+ * cache, so the first allocations skip mmap and page faults. Building with
+ * -DARENA_WARM_POOL=N does this for N arenas per class at startup.
+ */
+bool myMallocWarm(size_t arenasPerClass);
+
+/**
+ * Returns memory cached by the calling thread and the central free lists to
+ * the OS where possible, like glibc's malloc_trim.
+ */
+void myMallocTrim();
+
+/**
+ * The statistics gathered by the store behind myMalloc.
+ */
+const DefaultArenaStore::Stats& myMallocStats();
 
+/**
+ * Writes a summary of the live allocations behind myMalloc, like glibc's
+ * malloc_info.
+ */
+void myMallocInfo(std::ostream& out);
 
+/**
+ * At exit, after the calling thread's cache is flushed, lists whatever is
+ * still allocated through myMalloc on stderr. Building with
+ * -DARENA_LEAK_CHECK turns this on at startup.
+ */
+void myMallocEnableLeakCheck();
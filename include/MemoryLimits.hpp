@@ -0,0 +1,156 @@
+#pragma once
+#include <stddef.h>
+#include <atomic>
+
+/**
+ * Called when a mapping would take the process past the hard cap, with the
+ * bytes requested, the bytes mapped before it and the cap. Return true to let
+ * the mapping go ahead anyway, false to fail the allocation with nullptr.
+ *
+ * It may run with allocator locks held, so it must not allocate or free
+ * through the allocator.
+ */
+using MemoryLimitCallback = bool (*)(size_t requested, size_t mapped, size_t limit);
+
+/**
+ * Process-wide caps on the bytes the stores map, as counted by
+ * CountedPages::mappedBytes(): arenas, medium chunks and big allocations, and
+ * the thread caches and central list batches too. A cap of 0 means no cap.
+ *
+ * Crossing the soft cap flags memory pressure. The next store to take a slow
+ * path runs every registered releaseMemory hook (see Lifecycle.hpp), which
+ * trims the stores' empty arenas and purges the page policies' cached free
+ * pages. That happens once per crossing; the flag is rearmed when the mapped
+ * bytes fall back under the cap.
+ *
+ * A mapping that would exceed the hard cap goes to the callback, or fails if
+ * there is none. A store whose allocation failed that way releases memory as
+ * above and retries once before returning nullptr.
+ */
+class MemoryLimits {
+    inline static std::atomic<size_t> s_softLimit{0};
+    inline static std::atomic<size_t> s_hardLimit{0};
+    inline static std::atomic<MemoryLimitCallback> s_callback{nullptr};
+
+    // Set while above the soft cap, so only the crossing requests a purge.
+    inline static std::atomic<bool> s_overSoftLimit{false};
+    inline static std::atomic<bool> s_purgeRequested{false};
+
+public:
+    static void set(size_t softBytes, size_t hardBytes) {
+        s_softLimit.store(softBytes, std::memory_order_relaxed);
+        s_hardLimit.store(hardBytes, std::memory_order_relaxed);
+        s_overSoftLimit.store(false, std::memory_order_relaxed);
+    }
+
+    static void setCallback(MemoryLimitCallback callback) {
+        s_callback.store(callback, std::memory_order_release);
+    }
+
+    static size_t softLimit() {
+        return s_softLimit.load(std::memory_order_relaxed);
+    }
+
+    static size_t hardLimit() {
+        return s_hardLimit.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Whether a mapping of `requested` bytes that takes the total to `mapped`
+     * may go ahead.
+     */
+    static bool admit(size_t requested, size_t mapped) {
+        size_t hard = hardLimit();
+
+        if (hard != 0 && mapped > hard) {
+            MemoryLimitCallback callback = s_callback.load(std::memory_order_acquire);
+
+            if (callback == nullptr || !callback(requested, mapped - requested, hard)) {
+                return false;
+            }
+        }
+
+        size_t soft = softLimit();
+
+        if (soft != 0 && mapped > soft && !s_overSoftLimit.load(std::memory_order_relaxed)
+            && !s_overSoftLimit.exchange(true, std::memory_order_relaxed)) {
+            s_purgeRequested.store(true, std::memory_order_relaxed);
+        }
+
+        return true;
+    }
+
+    /**
+     * Notes that an unmapping brought the total down to `mapped`.
+     */
+    static void released(size_t mapped) {
+        if (s_overSoftLimit.load(std::memory_order_relaxed) && mapped <= softLimit()) {
+            s_overSoftLimit.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Whether a purge was requested since the last call. Only one caller gets
+     * true per request.
+     */
+    static bool takePurgeRequest() {
+        return s_purgeRequested.load(std::memory_order_relaxed)
+            && s_purgeRequested.exchange(false, std::memory_order_relaxed);
+    }
+
+    /**
+     * Sets the caps from a cgroup v2 memory.max file: the hard cap at 7/8 and
+     * the soft cap at 3/4 of the limit, leaving headroom for memory the
+     * allocator doesn't count (stacks, the binary, thread caches). Returns
+     * false, leaving the caps alone, if the file can't be read or says "max".
+     */
+    static bool fromCgroupFile(const char* path);
+
+    /**
+     * fromCgroupFile() on the calling process's own cgroup.
+     */
+    static bool fromCgroup();
+};
+
+/**
+ * Maps and unmaps through a page policy, keeping count of the bytes mapped
+ * and checking each mapping against MemoryLimits. Everything a store maps goes
+ * through here.
+ */
+class CountedPages {
+    inline static std::atomic<size_t> s_mappedBytes{0};
+
+public:
+    /**
+     * Maps `size` bytes through PagePolicy. Returns nullptr if that fails, or
+     * if the hard cap refuses it.
+     */
+    template <typename PagePolicy> static void* map(size_t size) {
+        size_t bytes = PagePolicy::roundUp(size);
+        size_t mapped = s_mappedBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+        if (!MemoryLimits::admit(bytes, mapped)) {
+            s_mappedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        void* region = PagePolicy::map(size);
+
+        if (region == nullptr) {
+            s_mappedBytes.fetch_sub(bytes, std::memory_order_relaxed);
+        }
+
+        return region;
+    }
+
+    template <typename PagePolicy> static void unmap(void* region, size_t size) {
+        size_t bytes = PagePolicy::roundUp(size);
+
+        PagePolicy::unmap(region, size);
+        MemoryLimits::released(s_mappedBytes.fetch_sub(bytes, std::memory_order_relaxed) - bytes);
+    }
+
+    static size_t mappedBytes() {
+        return s_mappedBytes.load(std::memory_order_relaxed);
+    }
+};
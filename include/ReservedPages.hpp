@@ -0,0 +1,454 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <sys/mman.h>
+
+#include <AllocatorPolicies.hpp>
+#include <Lifecycle.hpp>
+
+/**
+ * Page policy that carves regions out of large virtual address ranges
+ * reserved up front, rather than mapping each one separately.
+ *
+ * A range is reserved PROT_NONE and MAP_NORESERVE, so it costs neither memory
+ * nor commit charge until used. Regions are handed out in PageSize units,
+ * tracked by a per-range bitmap, and the range is committed (mprotect'd
+ * read/write) from the bottom up a chunk at a time as allocation reaches
+ * it. That keeps each range at two VMAs however many arenas live in it, and
+ * a steady-state map/unmap is a bitmap update with no syscall at all.
+ *
+ * Freed units stay committed and dirty so they can be reused for free. Once
+ * more than PurgeThreshold bytes are sitting dirty, they are handed back to the
+ * OS with madvise(MADV_DONTNEED), which keeps the mapping (and the VMA count)
+ * intact. Requests larger than MaxRunUnits units bypass the ranges and get
+ * their own mapping.
+ *
+ * The state is per instantiation and shared by every store using it. Its
+ * mutex is held across fork() so the child never inherits it mid-update.
+ */
+template <
+    size_t PageSize,
+    size_t RangeSize = 256 * 1024 * 1024,
+    size_t MaxRunUnits = 64,
+    size_t PurgeThreshold = 8 * 1024 * 1024
+> class ReservedPages {
+    static_assert(PageSize >= 4096 && (PageSize & (PageSize - 1)) == 0,
+        "PageSize must be a power of two multiple of the OS page");
+    static_assert(RangeSize % (64 * PageSize) == 0 && (RangeSize & (RangeSize - 1)) == 0,
+        "RangeSize must be a power of two holding a whole number of bitmap words");
+
+    static constexpr size_t unitsPerRange = RangeSize / PageSize;
+    static constexpr size_t bitmapWords = unitsPerRange / 64;
+
+    // How far the committed part of a range grows at a time.
+    static constexpr size_t commitUnits = (1024 * 1024 + PageSize - 1) / PageSize;
+
+    static constexpr size_t maxRanges = 256;
+    static constexpr size_t noRun = SIZE_MAX;
+
+    struct Range {
+        char* base;
+
+        // Units below this are read/write; the rest is still PROT_NONE.
+        size_t committed;
+
+        // No word below this has a free unit.
+        size_t hint;
+
+        // A set bit in used is a unit that's handed out; in dirty, a free unit
+        // whose pages haven't been given back to the OS yet; in warm, a free
+        // unit prefaulted by prewarm() and not handed out since.
+        uint64_t used[bitmapWords];
+        uint64_t dirty[bitmapWords];
+        uint64_t warm[bitmapWords];
+    };
+
+    // Range bases, published so owns() can check membership without the lock.
+    inline static std::atomic<char*> s_bases[maxRanges] = {};
+    inline static std::atomic<size_t> s_numRanges{0};
+
+    // Guards everything below and the contents of every Range.
+    inline static std::mutex s_mutex;
+    inline static Range* s_ranges[maxRanges] = {};
+    inline static size_t s_dirtyUnits = 0;
+    inline static std::atomic<size_t> s_committedBytes{0};
+
+    static void lockForFork(void* context) { s_mutex.lock(); }
+    static void unlockAfterFork(void* context) { s_mutex.unlock(); }
+    static void unlockInChild(void* context, size_t survivingIndex) { s_mutex.unlock(); }
+    static void purgeForPressure(void* context) { purge(); }
+
+    inline static LifecycleHooks s_lifecycle = {
+        lockForFork, unlockAfterFork, unlockInChild, nullptr, purgeForPressure, nullptr,
+        LifecycleHooks::PageTier, nullptr, {false}
+    };
+
+    static bool isSet(const uint64_t* bits, size_t unit) {
+        return bits[unit / 64] >> (unit % 64) & 1;
+    }
+
+    static void setBits(uint64_t* bits, size_t unit, size_t count, bool value) {
+        for (size_t i = unit; i < unit + count; i++) {
+            uint64_t mask = uint64_t(1) << (i % 64);
+            bits[i / 64] = value ? bits[i / 64] | mask : bits[i / 64] & ~mask;
+        }
+    }
+
+    static Range* rangeOf(const void* ptr) {
+        char* base = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(ptr) & ~(RangeSize - 1));
+        size_t count = s_numRanges.load(std::memory_order_acquire);
+
+        for (size_t i = 0; i < count; i++) {
+            if (s_bases[i].load(std::memory_order_relaxed) == base) {
+                return s_ranges[i];
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * First fit: the lowest run of `units` free units in the range.
+     */
+    static size_t findRun(Range* range, size_t units) {
+        size_t run = 0;
+        size_t unit = range->hint * 64;
+
+        while (unit < unitsPerRange) {
+            if (run == 0 && unit % 64 == 0 && range->used[unit / 64] == ~uint64_t(0)) {
+                unit += 64;
+                continue;
+            }
+
+            if (isSet(range->used, unit)) {
+                run = 0;
+            } else if (++run == units) {
+                return unit + 1 - units;
+            }
+
+            unit++;
+        }
+
+        return noRun;
+    }
+
+    /**
+     * Makes sure units below `end` are read/write.
+     */
+    static bool commit(Range* range, size_t end) {
+        if (end <= range->committed) {
+            return true;
+        }
+
+        size_t target = (end + commitUnits - 1) / commitUnits * commitUnits;
+        target = target < unitsPerRange ? target : unitsPerRange;
+
+        char* start = range->base + range->committed * PageSize;
+        size_t bytes = (target - range->committed) * PageSize;
+
+        PageSyscalls::count(PageSyscalls::mprotects);
+
+        if (mprotect(start, bytes, PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+
+        range->committed = target;
+        s_committedBytes.fetch_add(bytes, std::memory_order_relaxed);
+
+        return true;
+    }
+
+    static Range* reserveRange() {
+        size_t index = s_numRanges.load(std::memory_order_relaxed);
+
+        if (index == maxRanges) {
+            return nullptr;
+        }
+
+        // Over-reserve so the range can be aligned to its size, which is what
+        // lets rangeOf() find it by masking.
+        char* region = static_cast<char*>(mmap(
+            nullptr, 2 * RangeSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+        ));
+        PageSyscalls::count(PageSyscalls::mmaps);
+
+        if (region == MAP_FAILED) {
+            return nullptr;
+        }
+
+        char* base = reinterpret_cast<char*>(
+            (reinterpret_cast<uintptr_t>(region) + RangeSize - 1) & ~(RangeSize - 1)
+        );
+
+        if (base > region) {
+            munmap(region, base - region);
+            PageSyscalls::count(PageSyscalls::munmaps);
+        }
+
+        munmap(base + RangeSize, region + RangeSize - base);
+        PageSyscalls::count(PageSyscalls::munmaps);
+
+        Range* range = static_cast<Range*>(AnonymousPages<4096>::map(sizeof(Range)));
+
+        if (range == nullptr) {
+            munmap(base, RangeSize);
+            PageSyscalls::count(PageSyscalls::munmaps);
+            return nullptr;
+        }
+
+        range->base = base;
+        s_ranges[index] = range;
+        s_bases[index].store(base, std::memory_order_relaxed);
+        s_numRanges.store(index + 1, std::memory_order_release);
+
+        return range;
+    }
+
+    /**
+     * Whether a free unit still has pages a purge would give back.
+     */
+    static bool holdsPages(const Range* range, size_t unit, bool warmToo) {
+        return isSet(range->dirty, unit) || (warmToo && isSet(range->warm, unit));
+    }
+
+    /**
+     * Gives every dirty free unit's pages back to the OS, and with `warmToo`
+     * every warm one's. s_mutex must be held.
+     */
+    static void purgeLocked(bool warmToo) {
+        size_t count = s_numRanges.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i < count; i++) {
+            Range* range = s_ranges[i];
+            size_t unit = 0;
+
+            while (unit < range->committed) {
+                uint64_t word = range->dirty[unit / 64] | (warmToo ? range->warm[unit / 64] : 0);
+
+                if (word == 0 && unit % 64 == 0) {
+                    unit += 64;
+                    continue;
+                }
+
+                if (!holdsPages(range, unit, warmToo)) {
+                    unit++;
+                    continue;
+                }
+
+                size_t end = unit;
+
+                while (end < range->committed && holdsPages(range, end, warmToo)) {
+                    end++;
+                }
+
+                madvise(range->base + unit * PageSize, (end - unit) * PageSize, MADV_DONTNEED);
+                PageSyscalls::count(PageSyscalls::madvises);
+                setBits(range->dirty, unit, end - unit, false);
+                setBits(range->warm, unit, end - unit, false);
+                unit = end;
+            }
+        }
+
+        s_dirtyUnits = 0;
+    }
+
+public:
+    static constexpr size_t pageSize = PageSize;
+
+    static constexpr size_t roundUp(size_t bytes) {
+        return (bytes + PageSize - 1) & ~(PageSize - 1);
+    }
+
+    /**
+     * Maps at least `bytes` bytes, PageSize aligned. Returns nullptr on failure.
+     * Unlike a fresh mmap, a reused unit may still hold its old contents.
+     */
+    static void* map(size_t bytes) {
+        size_t units = roundUp(bytes) / PageSize;
+
+        if (units > MaxRunUnits) {
+            return AnonymousPages<PageSize>::map(bytes);
+        }
+
+        registerLifecycle();
+
+        std::lock_guard<std::mutex> guard(s_mutex);
+        size_t count = s_numRanges.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i <= count; i++) {
+            Range* range = i < count ? s_ranges[i] : reserveRange();
+
+            if (range == nullptr) {
+                break;
+            }
+
+            size_t unit = findRun(range, units);
+
+            if (unit == noRun) {
+                continue;
+            }
+
+            if (!commit(range, unit + units)) {
+                return nullptr;
+            }
+
+            for (size_t u = unit; u < unit + units; u++) {
+                if (isSet(range->dirty, u)) {
+                    s_dirtyUnits--;
+                }
+            }
+
+            setBits(range->used, unit, units, true);
+            setBits(range->dirty, unit, units, false);
+            setBits(range->warm, unit, units, false);
+
+            while (range->hint < bitmapWords && range->used[range->hint] == ~uint64_t(0)) {
+                range->hint++;
+            }
+
+            return range->base + unit * PageSize;
+        }
+
+        // Out of reservations; a mapping of its own is better than failing.
+        return AnonymousPages<PageSize>::map(bytes);
+    }
+
+    /**
+     * Unmaps a region previously returned by map(bytes).
+     */
+    static void unmap(void* addr, size_t bytes) {
+        Range* range = rangeOf(addr);
+
+        if (range == nullptr) {
+            AnonymousPages<PageSize>::unmap(addr, bytes);
+            return;
+        }
+
+        size_t units = roundUp(bytes) / PageSize;
+        size_t unit = (static_cast<char*>(addr) - range->base) / PageSize;
+
+        std::lock_guard<std::mutex> guard(s_mutex);
+
+        setBits(range->used, unit, units, false);
+        setBits(range->dirty, unit, units, true);
+        s_dirtyUnits += units;
+
+        if (unit / 64 < range->hint) {
+            range->hint = unit / 64;
+        }
+
+        if (s_dirtyUnits * PageSize > PurgeThreshold) {
+            purgeLocked(false);
+        }
+    }
+
+    /**
+     * Makes fork() safe for this policy. Stores call it before taking any of
+     * their locks, because registering takes the lifecycle registry's lock.
+     */
+    static void registerLifecycle() {
+        ensureLifecycleHooks(&s_lifecycle);
+    }
+
+    /**
+     * Whether ptr lies in one of the reserved ranges.
+     */
+    static bool owns(const void* ptr) {
+        return rangeOf(ptr) != nullptr;
+    }
+
+    /**
+     * Makes sure the first `bytes` worth of free units in the ranges have
+     * their pages, so the next maps of that much don't fault.
+     * Contiguous free units are faulted in with a single madvise. They stay
+     * out of the dirty count until they are first handed out, so unmaps
+     * crossing PurgeThreshold leave them be; only purge() gives them back.
+     */
+    static void prewarm(size_t bytes) {
+        size_t units = roundUp(bytes) / PageSize;
+
+        if (units == 0) {
+            return;
+        }
+
+        registerLifecycle();
+
+        std::lock_guard<std::mutex> guard(s_mutex);
+        size_t count = s_numRanges.load(std::memory_order_relaxed);
+
+        for (size_t i = 0; i <= count && units > 0; i++) {
+            Range* range = i < count ? s_ranges[i] : reserveRange();
+
+            if (range == nullptr) {
+                return;
+            }
+
+            size_t unit = range->hint * 64;
+
+            while (unit < unitsPerRange && units > 0) {
+                // A dirty free unit is warm already.
+                if (isSet(range->used, unit) || holdsPages(range, unit, true)) {
+                    units -= !isSet(range->used, unit);
+                    unit++;
+                    continue;
+                }
+
+                size_t end = unit;
+
+                while (end < unitsPerRange && end - unit < units
+                    && !isSet(range->used, end) && !holdsPages(range, end, true)) {
+                    end++;
+                }
+
+                if (!commit(range, end)) {
+                    return;
+                }
+
+                PageSyscalls::prefault(range->base + unit * PageSize, (end - unit) * PageSize);
+                setBits(range->warm, unit, end - unit, true);
+                units -= end - unit;
+                unit = end;
+            }
+        }
+    }
+
+    /**
+     * Hands the pages of every free unit back to the OS now, warm ones
+     * included.
+     */
+    static void purge() {
+        std::lock_guard<std::mutex> guard(s_mutex);
+        purgeLocked(true);
+    }
+
+    /**
+     * Bytes of address space reserved for ranges.
+     */
+    static size_t reservedBytes() {
+        return s_numRanges.load(std::memory_order_relaxed) * RangeSize;
+    }
+
+    /**
+     * Bytes of the ranges made read/write so far. Purged units still count;
+     * they keep their protection and just lose their backing pages.
+     */
+    static size_t committedBytes() {
+        return s_committedBytes.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Bytes in free units that still hold pages the OS hasn't been given back,
+     * not counting warm units nobody has used yet.
+     */
+    static size_t dirtyBytes() {
+        std::lock_guard<std::mutex> guard(s_mutex);
+        return s_dirtyUnits * PageSize;
+    }
+};
+
+/**
+ * The page policy everything uses unless told otherwise.
+ */
+using DefaultPages = ReservedPages<pageSize>;
@@ -0,0 +1,797 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+
+#include <AllocatorPolicies.hpp>
+
+/**
+ * A MAP_SHARED mapping of a memfd or POSIX shared memory object, unmapped and
+ * closed when it goes out of scope. Every factory returns an invalid region
+ * on failure.
+ */
+class SharedRegion {
+    char* m_base = nullptr;
+    size_t m_size = 0;
+    int m_fd = -1;
+
+    SharedRegion(char* base, size_t size, int fd) : m_base(base), m_size(size), m_fd(fd) { }
+
+    // Maps all `size` bytes of `fd`, which the region then owns. Closes it on
+    // failure.
+    static SharedRegion mapOwned(int fd, size_t size);
+
+public:
+    SharedRegion() = default;
+    SharedRegion(const SharedRegion& other) = delete;
+    SharedRegion(SharedRegion&& other);
+    SharedRegion& operator=(SharedRegion&& other);
+    ~SharedRegion();
+
+    /**
+     * A new zero-filled memfd of `size` bytes. It has no name in the file
+     * system: children inherit it across fork(), and other processes get it
+     * as a file descriptor over a Unix socket.
+     */
+    static SharedRegion anonymous(const char* name, size_t size);
+
+    /**
+     * The shm_open object `name` ("/something"). With `create` it must not
+     * exist yet, and is made `size` bytes long; otherwise `size` is ignored
+     * and the whole object is mapped.
+     */
+    static SharedRegion named(const char* name, size_t size, bool create);
+
+    /**
+     * Maps the whole of a file descriptor received from another process.
+     * The region gets a duplicate, so the caller still owns `fd`.
+     */
+    static SharedRegion fromFd(int fd);
+
+    /**
+     * The regular file at `path`, which is created `size` bytes long if it
+     * doesn't exist and otherwise mapped whole, so that what is allocated in
+     * it outlives the process. See SharedArena::checkpoint().
+     */
+    static SharedRegion file(const char* path, size_t size);
+
+    /**
+     * Removes a shm_open name. Regions already mapped stay valid.
+     */
+    static bool unlink(const char* name);
+
+    bool valid() const { return m_base != nullptr; }
+    char* base() const { return m_base; }
+    size_t size() const { return m_size; }
+    int fd() const { return m_fd; }
+};
+
+/**
+ * Writes part of a file-backed region back to its file, synchronously.
+ */
+using RegionSyncFunction = bool (*)(void* addr, size_t bytes);
+
+/**
+ * How SharedArena syncs a region, process-wide: msync(MS_SYNC) unless a
+ * function is installed in its place, to watch or fail the syncs in tests.
+ */
+class RegionSync {
+    inline static std::atomic<RegionSyncFunction> s_sync{nullptr};
+
+public:
+    static void setFunction(RegionSyncFunction sync) {
+        s_sync.store(sync, std::memory_order_release);
+    }
+
+    static bool sync(void* addr, size_t bytes) {
+        RegionSyncFunction sync = s_sync.load(std::memory_order_acquire);
+
+        return sync != nullptr ? sync(addr, bytes) : msync(addr, bytes, MS_SYNC) == 0;
+    }
+};
+
+/**
+ * An allocator that lives entirely inside a shared region, so that every
+ * process mapping the region can allocate from it and free into it, and hand
+ * objects to each other by offset without copying them.
+ *
+ * Nothing in the region is a pointer. The header at its start holds a lock-
+ * free free list per size class, whose links are offsets from the header
+ * stored in the free slots themselves, and a page table saying what each page
+ * after it is: a page of slots of one class, or the first page of a run of
+ * pages handed out whole to an allocation bigger than the classes. Free runs
+ * are kept in offset order and merged with their neighbours, under a spin lock
+ * in the header. Only lock-free std::atomics are used, which are address-free,
+ * so they work across processes whatever address each maps the region at.
+ *
+ * Pages given to a class stay with it, so a slot popped by one process while
+ * another reuses it is still a slot; the tag in each list head catches that.
+ * Processes share no thread caches, and forking needs no hooks: a lock held
+ * by a thread of the parent is still released by that thread.
+ *
+ * A process that dies while holding the page lock leaves it held; one that
+ * dies between taking a slot and using it leaks the slot. Both are recovered
+ * by restoring the region once its users have gone, below.
+ *
+ * Over a file (SharedRegion::file), the arena survives restarts. checkpoint()
+ * msyncs the whole region while it is still marked open, and only once that
+ * has succeeded marks it clean and msyncs the header. The first alloc, free
+ * or setRoot after that marks it open again, and msyncs the header before
+ * going on, so the file never claims to be clean while the allocator's
+ * metadata on disk is newer than the checkpoint. After a restart, restore()
+ * maps the arena back in: if it is clean, every object is where it was and
+ * nothing needs rebuilding. If not, the process stopped mid-flight, and
+ * recover() rebuilds the free lists, free runs and page table from the
+ * objects the application can still reach, so whatever it didn't reach is
+ * freed. The application's own objects are only as consistent as the writes
+ * it made to them; checkpoint when they are.
+ *
+ *     SharedRegion region = SharedRegion::anonymous("messages", 64 << 20);
+ *     auto* arena = SharedArena<>::create(region.base(), region.size());
+ *     Message* message = new (arena->alloc(sizeof(Message))) Message();
+ *     arena->setRoot(arena->offsetOf(message));
+ *
+ * and in a process that mapped the same region at some other address,
+ *
+ *     auto* arena = SharedArena<>::attach(region.base(), region.size());
+ *     Message* message = static_cast<Message*>(arena->at(arena->root()));
+ */
+template <typename SizeClassPolicy = PowerOfTwoSizeClasses> class SharedArena {
+public:
+    static constexpr size_t numClasses = SizeClassPolicy::numClasses;
+    static constexpr size_t pageSize = 4096;
+
+    // List heads keep slot offsets in ALIGNMENT units in 32 bits, next to a
+    // 32-bit tag.
+    static constexpr size_t maxRegionSize = (size_t(1) << 32) * ALIGNMENT;
+
+private:
+    static_assert(SizeClassPolicy::maxSize <= pageSize, "Shared classes must fit in a page");
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free
+        && std::atomic<bool>::is_always_lock_free, "Shared atomics must be lock-free to be address-free");
+
+    static constexpr uint64_t regionMagic = 0x4d55444552414853; // "SHAREDUM"
+    static constexpr uint32_t regionVersion = 1;
+
+    // A page table entry is 0 for a page nobody owns, 1 + the class for a
+    // page of slots, and runFlag | the length for the first page of a run.
+    static constexpr uint32_t runFlag = 0x80000000;
+
+    static constexpr uint64_t noPage = ~uint64_t(0);
+
+    enum State : uint32_t {
+        // In use, or stopped without a checkpoint since it was last changed.
+        Open = 1,
+        // Unchanged since the last checkpoint.
+        Clean = 2,
+        // Changing back from Clean to Open.
+        Reopening = 3
+    };
+
+    /**
+     * Kept in the first page of a free run.
+     */
+    struct FreeRun {
+        uint64_t next;
+        uint64_t pages;
+    };
+
+    std::atomic<uint64_t> m_magic{0};
+    uint32_t m_version;
+    uint32_t m_numClasses;
+    uint64_t m_maxSize;
+    uint64_t m_size;
+
+    // The offset of page 0, and how many pages there are.
+    uint64_t m_firstPage;
+    uint64_t m_numPages;
+
+    std::atomic<uint64_t> m_root{0};
+    std::atomic<uint64_t> m_freeSlots[numClasses] = {};
+    std::atomic<uint32_t> m_state{Open};
+    uint32_t m_checkpoints = 0;
+
+    // Guards everything below.
+    SpinLock m_pagesLock;
+
+    // Pages past this one have never been handed out.
+    uint64_t m_bump = 0;
+    uint64_t m_freeRuns = noPage;
+    uint64_t m_pagesInUse = 0;
+
+    // The page table follows, then page 0 on the next page boundary.
+
+    explicit SharedArena(size_t size) : m_version(regionVersion), m_numClasses(numClasses),
+        m_maxSize(SizeClassPolicy::maxSize), m_size(size) {
+
+        size_t pages = (size - tableOffset()) / (pageSize + sizeof(uint32_t));
+
+        while (pages > 0 && roundUp(tableOffset() + pages * sizeof(uint32_t)) + pages * pageSize > size) {
+            pages--;
+        }
+
+        m_numPages = pages;
+        m_firstPage = roundUp(tableOffset() + pages * sizeof(uint32_t));
+
+        for (size_t i = 0; i < pages; i++) {
+            new (&pageTable()[i]) std::atomic<uint32_t>(0);
+        }
+    }
+
+    static constexpr size_t tableOffset() {
+        return (sizeof(SharedArena) + 7) & ~size_t(7);
+    }
+
+    static constexpr size_t roundUp(size_t bytes) {
+        return (bytes + pageSize - 1) & ~(pageSize - 1);
+    }
+
+    // The header, a one-entry page table and the one page it covers.
+    static constexpr size_t minRegionSize() {
+        return roundUp(tableOffset() + sizeof(uint32_t)) + pageSize;
+    }
+
+    char* base() const {
+        return reinterpret_cast<char*>(const_cast<SharedArena*>(this));
+    }
+
+    std::atomic<uint32_t>* pageTable() const {
+        return reinterpret_cast<std::atomic<uint32_t>*>(base() + tableOffset());
+    }
+
+    char* page(uint64_t index) const {
+        return base() + m_firstPage + index * pageSize;
+    }
+
+    uint64_t pageOf(const void* ptr) const {
+        return (static_cast<const char*>(ptr) - base() - m_firstPage) / pageSize;
+    }
+
+    FreeRun* run(uint64_t index) const {
+        return reinterpret_cast<FreeRun*>(page(index));
+    }
+
+    static std::atomic<uint64_t>& link(char* slot) {
+        return *reinterpret_cast<std::atomic<uint64_t>*>(slot);
+    }
+
+    static uint64_t retag(uint64_t head, uint64_t units) {
+        return ((head >> 32) + 1) << 32 | units;
+    }
+
+    char* slotAt(uint64_t units) const {
+        return units == 0 ? nullptr : base() + units * ALIGNMENT;
+    }
+
+    uint64_t unitsOf(const char* slot) const {
+        return (slot - base()) / ALIGNMENT;
+    }
+
+    char* pop(size_t cls) {
+        std::atomic<uint64_t>& head = m_freeSlots[cls];
+        uint64_t top = head.load(std::memory_order_acquire);
+
+        while (char* slot = slotAt(top & 0xffffffff)) {
+            // Another process may have popped the slot and written over the
+            // link already, in which case the tag has moved on and this fails.
+            uint64_t next = link(slot).load(std::memory_order_relaxed);
+
+            if (head.compare_exchange_weak(top, retag(top, next), std::memory_order_acquire,
+                    std::memory_order_acquire)) {
+                return slot;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /**
+     * Pushes the chain of slots from `first` to `last`, already linked to
+     * each other, onto the class's list.
+     */
+    void push(size_t cls, char* first, char* last) {
+        std::atomic<uint64_t>& head = m_freeSlots[cls];
+        uint64_t top = head.load(std::memory_order_relaxed);
+
+        do {
+            link(last).store(top & 0xffffffff, std::memory_order_relaxed);
+        } while (!head.compare_exchange_weak(top, retag(top, unitsOf(first)), std::memory_order_release,
+            std::memory_order_relaxed));
+    }
+
+    /**
+     * Carves a fresh page into slots of the class, keeps one and pushes the
+     * rest.
+     */
+    char* refill(size_t cls) {
+        uint64_t index = allocPages(1);
+
+        if (index == noPage) {
+            return nullptr;
+        }
+
+        pageTable()[index].store(uint32_t(1 + cls), std::memory_order_relaxed);
+
+        size_t size = SizeClassPolicy::sizeOf(cls);
+        size_t count = pageSize / size;
+        char* first = page(index);
+
+        if (count > 1) {
+            for (size_t i = 1; i + 1 < count; i++) {
+                link(first + i * size).store(unitsOf(first + (i + 1) * size), std::memory_order_relaxed);
+            }
+
+            push(cls, first + size, first + (count - 1) * size);
+        }
+
+        return first;
+    }
+
+    /**
+     * Called before anything in the region changes, to mark a clean region
+     * open on disk first.
+     */
+    void touch() {
+        if (m_state.load(std::memory_order_acquire) != Open) {
+            reopen();
+        }
+    }
+
+    void reopen() {
+        std::lock_guard<SpinLock> guard(m_pagesLock);
+
+        // Others wait for the header to reach the disk before changing
+        // anything, which is why they only go ahead once it says Open.
+        if (m_state.load(std::memory_order_relaxed) == Clean) {
+            m_state.store(Reopening, std::memory_order_relaxed);
+            RegionSync::sync(base(), pageSize);
+            m_state.store(Open, std::memory_order_release);
+        }
+    }
+
+    /**
+     * Takes `pages` contiguous pages from the end of the first free run that
+     * is long enough, or from never used ones. Returns noPage if there is no
+     * room.
+     */
+    uint64_t allocPages(uint64_t pages) {
+        std::lock_guard<SpinLock> guard(m_pagesLock);
+
+        for (uint64_t* cursor = &m_freeRuns; *cursor != noPage; cursor = &run(*cursor)->next) {
+            FreeRun* candidate = run(*cursor);
+
+            if (candidate->pages > pages) {
+                candidate->pages -= pages;
+                m_pagesInUse += pages;
+                return *cursor + candidate->pages;
+            }
+
+            if (candidate->pages == pages) {
+                uint64_t index = *cursor;
+                *cursor = candidate->next;
+                m_pagesInUse += pages;
+                return index;
+            }
+        }
+
+        if (m_numPages - m_bump < pages) {
+            return noPage;
+        }
+
+        m_bump += pages;
+        m_pagesInUse += pages;
+
+        return m_bump - pages;
+    }
+
+    /**
+     * Returns a run to the free runs, merged with the runs either side of it,
+     * or to the never used pages if it ends up last.
+     */
+    void freePages(uint64_t index, uint64_t pages) {
+        std::lock_guard<SpinLock> guard(m_pagesLock);
+        m_pagesInUse -= pages;
+
+        uint64_t* cursor = &m_freeRuns;
+        uint64_t* before = nullptr;
+
+        while (*cursor != noPage && *cursor < index) {
+            before = cursor;
+            cursor = &run(*cursor)->next;
+        }
+
+        uint64_t after = *cursor;
+
+        if (after != noPage && index + pages == after) {
+            pages += run(after)->pages;
+            after = run(after)->next;
+        }
+
+        if (before != nullptr && *before + run(*before)->pages == index) {
+            index = *before;
+            pages += run(index)->pages;
+            cursor = before;
+        }
+
+        if (index + pages == m_bump) {
+            m_bump = index;
+            *cursor = noPage;
+            return;
+        }
+
+        run(index)->next = after;
+        run(index)->pages = pages;
+        *cursor = index;
+    }
+
+public:
+    SharedArena(const SharedArena& other) = delete;
+
+    /**
+     * Sets up an empty arena over `size` bytes at `base`, which must be page
+     * aligned, and returns it. Whatever the bytes held is lost. Returns
+     * nullptr if base isn't page aligned, or if the region is too small to
+     * hold the header, its page table and a page, or bigger than
+     * maxRegionSize.
+     */
+    static SharedArena* create(void* base, size_t size) {
+        if (base == nullptr || reinterpret_cast<uintptr_t>(base) % pageSize != 0
+            || size > maxRegionSize || size < minRegionSize()) {
+            return nullptr;
+        }
+
+        SharedArena* arena = new (base) SharedArena(size);
+        arena->m_magic.store(regionMagic, std::memory_order_release);
+
+        return arena;
+    }
+
+    /**
+     * The arena another process created over the same region, wherever this
+     * process has mapped it. Returns nullptr if the region doesn't hold one,
+     * or holds one of a different size or with different size classes.
+     */
+    static SharedArena* attach(void* base, size_t size) {
+        auto* arena = static_cast<SharedArena*>(base);
+
+        if (base == nullptr || size < sizeof(SharedArena)
+            || arena->m_magic.load(std::memory_order_acquire) != regionMagic
+            || arena->m_version != regionVersion
+            || arena->m_numClasses != numClasses
+            || arena->m_maxSize != SizeClassPolicy::maxSize
+            || arena->m_size != size) {
+            return nullptr;
+        }
+
+        return arena;
+    }
+
+    /**
+     * Maps back in an arena that an earlier run left in a file, once no other
+     * process uses it. Returns nullptr if the region doesn't hold a matching
+     * one, like attach(). If needsRecovery(), recover() it before anything
+     * else.
+     */
+    static SharedArena* restore(void* base, size_t size) {
+        SharedArena* arena = attach(base, size);
+
+        if (arena != nullptr) {
+            // Whoever held the page lock is gone. checkpoint() holds it too,
+            // so a clean file has it held.
+            new (&arena->m_pagesLock) SpinLock();
+        }
+
+        return arena;
+    }
+
+    /**
+     * Whether the region changed after its last checkpoint, or never had one.
+     */
+    bool needsRecovery() const {
+        return m_state.load(std::memory_order_acquire) != Clean;
+    }
+
+    /**
+     * Writes the whole region back to its file and marks it clean there. No
+     * process may be allocating or freeing while it runs. Returns false,
+     * leaving the region open, if either msync fails.
+     */
+    bool checkpoint() {
+        std::lock_guard<SpinLock> guard(m_pagesLock);
+
+        // The data goes first, under an open header, so the file never says
+        // clean over metadata that hasn't reached it. Writeback may still
+        // flush the clean header early, but only once the data is on disk.
+        m_state.store(Open, std::memory_order_relaxed);
+        m_checkpoints++;
+
+        if (!RegionSync::sync(base(), m_size)) {
+            m_checkpoints--;
+            return false;
+        }
+
+        m_state.store(Clean, std::memory_order_relaxed);
+
+        if (!RegionSync::sync(base(), pageSize)) {
+            m_state.store(Open, std::memory_order_relaxed);
+            m_checkpoints--;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Rebuilds the page table, free runs and free lists of a region that
+     * needsRecovery() from the objects still in use. `walk(mark)` must call
+     * mark(ptr, bytes) once for each of them, with the size it was allocated
+     * with, usually by following offsets from root(); everything else is free
+     * afterwards. Returns false, changing nothing, if an object is outside the
+     * region, misaligned for its size, or overlaps another object or a page
+     * of another class.
+     */
+    template <typename Walk> bool recover(Walk walk) {
+        constexpr size_t wordsPerPage = (pageSize / smallestSlot<SizeClassPolicy>() + 63) / 64;
+
+        std::vector<uint32_t> table(m_numPages, 0);
+        std::vector<bool> claimed(m_numPages, false);
+        std::vector<uint64_t> live(m_numPages * wordsPerPage, 0);
+        bool consistent = true;
+
+        walk([&](const void* ptr, size_t bytes) {
+            if (!consistent || !contains(ptr)) {
+                consistent = false;
+                return;
+            }
+
+            uint64_t index = pageOf(ptr);
+            size_t offset = static_cast<const char*>(ptr) - page(index);
+
+            if (bytes <= SizeClassPolicy::maxSize) {
+                size_t cls = SizeClassPolicy::classOf(bytes);
+                size_t size = SizeClassPolicy::sizeOf(cls);
+                size_t slot = offset / size;
+                uint64_t& word = live[index * wordsPerPage + slot / 64];
+                uint64_t bit = uint64_t(1) << (slot % 64);
+
+                if (offset % size != 0 || slot >= pageSize / size || (word & bit)
+                    || (claimed[index] && table[index] != 1 + cls)) {
+                    consistent = false;
+                    return;
+                }
+
+                table[index] = uint32_t(1 + cls);
+                claimed[index] = true;
+                word |= bit;
+                return;
+            }
+
+            uint64_t pages = roundUp(bytes) / pageSize;
+
+            if (offset != 0 || pages > m_numPages - index) {
+                consistent = false;
+                return;
+            }
+
+            for (uint64_t i = index; i < index + pages; i++) {
+                if (claimed[i]) {
+                    consistent = false;
+                    return;
+                }
+
+                claimed[i] = true;
+            }
+
+            table[index] = runFlag | uint32_t(pages);
+        });
+
+        if (!consistent) {
+            return false;
+        }
+
+        std::lock_guard<SpinLock> guard(m_pagesLock);
+        m_bump = 0;
+        m_pagesInUse = 0;
+
+        for (uint64_t i = 0; i < m_numPages; i++) {
+            pageTable()[i].store(table[i], std::memory_order_relaxed);
+
+            if (claimed[i]) {
+                m_bump = i + 1;
+                m_pagesInUse++;
+            }
+        }
+
+        // Unclaimed pages below the last claimed one become free runs, in
+        // offset order.
+        uint64_t* cursor = &m_freeRuns;
+
+        for (uint64_t i = 0; i < m_bump; ) {
+            if (claimed[i]) {
+                i++;
+                continue;
+            }
+
+            uint64_t end = i;
+
+            while (!claimed[end]) {
+                end++;
+            }
+
+            run(i)->pages = end - i;
+            *cursor = i;
+            cursor = &run(i)->next;
+            i = end;
+        }
+
+        *cursor = noPage;
+
+        // And every slot nobody marked goes back on its class's list.
+        for (size_t cls = 0; cls < numClasses; cls++) {
+            m_freeSlots[cls].store(0, std::memory_order_relaxed);
+        }
+
+        for (uint64_t i = 0; i < m_bump; i++) {
+            if (table[i] == 0 || (table[i] & runFlag)) {
+                continue;
+            }
+
+            size_t cls = table[i] - 1;
+            size_t size = SizeClassPolicy::sizeOf(cls);
+            char* first = nullptr;
+            char* last = nullptr;
+
+            for (size_t slot = 0; slot < pageSize / size; slot++) {
+                if (live[i * wordsPerPage + slot / 64] & uint64_t(1) << (slot % 64)) {
+                    continue;
+                }
+
+                char* vacant = page(i) + slot * size;
+
+                if (last != nullptr) {
+                    link(last).store(unitsOf(vacant), std::memory_order_relaxed);
+                } else {
+                    first = vacant;
+                }
+
+                last = vacant;
+            }
+
+            if (first != nullptr) {
+                push(cls, first, last);
+            }
+        }
+
+        m_state.store(Open, std::memory_order_release);
+
+        return true;
+    }
+
+    /**
+     * The number of checkpoints taken over the region's life.
+     */
+    uint32_t checkpoints() const {
+        return m_checkpoints;
+    }
+
+    /**
+     * Allocates from the region. Class-sized items are aligned to their
+     * size; bigger ones get whole pages. Returns nullptr when the region is
+     * full.
+     */
+    void* alloc(size_t bytes) {
+        touch();
+
+        if (bytes <= SizeClassPolicy::maxSize) {
+            size_t cls = SizeClassPolicy::classOf(bytes);
+            char* slot = pop(cls);
+
+            return slot != nullptr ? slot : refill(cls);
+        }
+
+        if (bytes > m_numPages * pageSize) {
+            return nullptr;
+        }
+
+        uint64_t pages = roundUp(bytes) / pageSize;
+        uint64_t index = allocPages(pages);
+
+        if (index == noPage) {
+            return nullptr;
+        }
+
+        pageTable()[index].store(runFlag | uint32_t(pages), std::memory_order_relaxed);
+
+        return page(index);
+    }
+
+    /**
+     * Frees something allocated from the region by any process. A pointer
+     * into a page that holds neither slots nor the start of a run can't have
+     * come from alloc(), and is ignored.
+     */
+    void free(void* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+
+        uint64_t index = pageOf(ptr);
+        uint32_t entry = index < m_numPages ? pageTable()[index].load(std::memory_order_relaxed) : 0;
+
+        if (entry == 0) {
+            return;
+        }
+
+        touch();
+
+        if (entry & runFlag) {
+            pageTable()[index].store(0, std::memory_order_relaxed);
+            freePages(index, entry & ~runFlag);
+            return;
+        }
+
+        char* slot = static_cast<char*>(ptr);
+        push(entry - 1, slot, slot);
+    }
+
+    size_t usableSize(const void* ptr) const {
+        uint32_t entry = pageTable()[pageOf(ptr)].load(std::memory_order_relaxed);
+
+        if (entry == 0) {
+            return 0;
+        }
+
+        return entry & runFlag ? (entry & ~runFlag) * pageSize : SizeClassPolicy::sizeOf(entry - 1);
+    }
+
+    bool contains(const void* ptr) const {
+        const char* p = static_cast<const char*>(ptr);
+
+        return p >= page(0) && p < page(m_numPages);
+    }
+
+    /**
+     * Where `ptr` is relative to the region, the same in every process. 0 for
+     * nullptr.
+     */
+    uint64_t offsetOf(const void* ptr) const {
+        return ptr == nullptr ? 0 : static_cast<const char*>(ptr) - base();
+    }
+
+    /**
+     * The address of an offset in this process. nullptr for 0.
+     */
+    void* at(uint64_t offset) const {
+        return offset == 0 ? nullptr : base() + offset;
+    }
+
+    /**
+     * A single offset every process can see, to publish the root of an
+     * object graph through.
+     */
+    void setRoot(uint64_t offset) {
+        touch();
+        m_root.store(offset, std::memory_order_release);
+    }
+
+    uint64_t root() const {
+        return m_root.load(std::memory_order_acquire);
+    }
+
+    size_t numPages() const {
+        return m_numPages;
+    }
+
+    /**
+     * Pages held by classes and by allocations bigger than them.
+     */
+    size_t pagesInUse() {
+        std::lock_guard<SpinLock> guard(m_pagesLock);
+
+        return m_pagesInUse;
+    }
+};
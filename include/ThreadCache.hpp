@@ -0,0 +1,227 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#include <MemoryLimits.hpp>
+
+/**
+ * Threads that use ArenaStore's thread caches are handed a small dense index,
+ * which selects their cache in every store. Indices are recycled when a thread
+ * exits, so a new thread inherits whatever its predecessor left cached.
+ */
+constexpr size_t maxThreadIndices = 256;
+
+// The calling thread hasn't asked for an index yet.
+constexpr size_t unassignedThreadIndex = SIZE_MAX;
+
+// Every index is taken, or the thread is exiting. Such threads bypass the
+// caches entirely.
+constexpr size_t noThreadIndex = SIZE_MAX - 1;
+
+inline thread_local size_t t_threadIndex = unassignedThreadIndex;
+
+/**
+ * Slow path of threadIndex(): claims a free index for the calling thread and
+ * arranges for it to be released when the thread exits.
+ */
+size_t acquireThreadIndex();
+
+/**
+ * In a freshly forked child, frees every index but the forking thread's; the
+ * threads that held them don't exist there.
+ */
+void resetThreadIndicesAfterFork();
+
+/**
+ * Returns the calling thread's index, or noThreadIndex if it has none.
+ */
+inline size_t threadIndex() {
+    size_t index = t_threadIndex;
+
+    if (index != unassignedThreadIndex) {
+        return index;
+    }
+
+    return acquireThreadIndex();
+}
+
+/**
+ * A batch of free slots of one size class. Thread caches exchange slots with
+ * the central free list a whole batch at a time.
+ *
+ * Batches live in type-stable memory owned by a BatchPool and are never
+ * unmapped while the pool is alive, which is what lets a racing pop read the
+ * next link of a batch someone else already took.
+ */
+struct SlotBatch {
+    static constexpr size_t maxSlots = 32;
+
+    // Pool index of the next batch on the stack, or 0 for none.
+    std::atomic<uint32_t> next;
+    uint32_t index;
+    size_t count;
+    void* slots[maxSlots];
+};
+
+/**
+ * Treiber stack of SlotBatches from one BatchPool. The head word holds the top
+ * batch's pool index in its low 32 bits and a 32-bit tag, bumped on every
+ * update, in the high ones, so a pop racing with a pop-push of the same batch
+ * fails its CAS instead of linking in a stale next index (the ABA problem).
+ * Indices rather than pointers keep the packing independent of how wide user
+ * addresses are.
+ */
+class TaggedBatchStack {
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "Tagged heads need a lock-free 64-bit CAS");
+
+    std::atomic<uint64_t> m_head{0};
+
+    // Number of batches on the stack. Bumped before a push lands and dropped
+    // after a pop, so it never underflows; it may briefly overcount.
+    std::atomic<size_t> m_size{0};
+
+    static uint32_t index(uint64_t head) {
+        return static_cast<uint32_t>(head);
+    }
+
+    static uint64_t retag(uint64_t head, uint32_t index) {
+        return ((head >> 32) + 1) << 32 | index;
+    }
+
+public:
+    constexpr TaggedBatchStack() = default;
+    TaggedBatchStack(const TaggedBatchStack& other) = delete;
+
+    void push(SlotBatch* batch) {
+        m_size.fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+
+        do {
+            batch->next.store(index(head), std::memory_order_relaxed);
+        } while (!m_head.compare_exchange_weak(
+            head, retag(head, batch->index), std::memory_order_release, std::memory_order_relaxed
+        ));
+    }
+
+    /**
+     * Pops a batch, or returns nullptr if the stack is empty. Never blocks.
+     * `pool` is the BatchPool the stack's batches came from.
+     */
+    template <typename Pool> SlotBatch* pop(const Pool& pool) {
+        uint64_t head = m_head.load(std::memory_order_acquire);
+
+        while (index(head) != 0) {
+            SlotBatch* batch = pool.at(index(head));
+            uint32_t next = batch->next.load(std::memory_order_relaxed);
+
+            if (m_head.compare_exchange_weak(
+                head, retag(head, next), std::memory_order_acquire, std::memory_order_acquire
+            )) {
+                m_size.fetch_sub(1, std::memory_order_relaxed);
+
+                return batch;
+            }
+        }
+
+        return nullptr;
+    }
+
+    size_t size() const {
+        return m_size.load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Type-stable storage for SlotBatches. Grows a chunk at a time through
+ * PagePolicy, counted against MemoryLimits, and only gives memory back when
+ * destroyed. Batches are numbered across chunks; index 0 is never handed out,
+ * so stacks can use it for none.
+ */
+template <typename PagePolicy> class BatchPool {
+    static constexpr size_t chunkBatches = 256;
+    static constexpr size_t chunkSize = PagePolicy::roundUp(chunkBatches * sizeof(SlotBatch));
+
+public:
+    // Up to 64Ki batches, or 2Mi slots, on the central lists and in flight.
+    // Past that acquire() fails and stores fall back to their locks.
+    static constexpr size_t maxChunks = 256;
+
+private:
+    std::atomic<SlotBatch*> m_chunks[maxChunks] = {};
+    std::atomic<size_t> m_numChunks{0};
+    TaggedBatchStack m_free;
+
+public:
+    constexpr BatchPool() = default;
+    BatchPool(const BatchPool& other) = delete;
+
+    ~BatchPool() {
+        for (size_t i = 0; i < maxChunks; i++) {
+            if (SlotBatch* chunk = m_chunks[i].load()) {
+                CountedPages::unmap<PagePolicy>(chunk, chunkSize);
+            }
+        }
+    }
+
+    SlotBatch* at(uint32_t index) const {
+        return m_chunks[index / chunkBatches].load(std::memory_order_acquire) + index % chunkBatches;
+    }
+
+    /**
+     * Returns an unused batch, or nullptr if no more memory could be mapped.
+     */
+    SlotBatch* acquire() {
+        if (SlotBatch* batch = m_free.pop(*this)) {
+            return batch;
+        }
+
+        size_t chunk = m_numChunks.load(std::memory_order_relaxed);
+
+        do {
+            if (chunk == maxChunks) {
+                return nullptr;
+            }
+        } while (!m_numChunks.compare_exchange_weak(chunk, chunk + 1, std::memory_order_relaxed));
+
+        SlotBatch* batches = static_cast<SlotBatch*>(CountedPages::map<PagePolicy>(chunkSize));
+
+        if (batches == nullptr) {
+            // The claimed chunk stays empty; the pool just ends up one short.
+            return nullptr;
+        }
+
+        for (size_t i = 0; i < chunkBatches; i++) {
+            batches[i].index = static_cast<uint32_t>(chunk * chunkBatches + i);
+        }
+
+        m_chunks[chunk].store(batches, std::memory_order_release);
+
+        // Batch 0 of chunk 0 would have index 0, so it is skipped.
+        size_t first = chunk == 0 ? 1 : 0;
+
+        for (size_t i = first + 1; i < chunkBatches; i++) {
+            m_free.push(&batches[i]);
+        }
+
+        return &batches[first];
+    }
+
+    void release(SlotBatch* batch) {
+        m_free.push(batch);
+    }
+};
+
+/**
+ * One thread's cached free slots for a store with NumClasses size classes.
+ * Only the owning thread touches it, so it needs no synchronization.
+ */
+template <size_t NumClasses> struct ThreadCache {
+    struct Bin {
+        size_t count;
+        void* slots[2 * SlotBatch::maxSlots];
+    };
+
+    Bin bins[NumClasses];
+};
@@ -0,0 +1,12 @@
+#include <Canaries.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+
+void CanaryReports::reportAndAbort(CanaryFault fault, const void* slot, uint32_t generation) {
+    const char* what = fault == CanaryFault::DoubleFree ? "double free"
+        : fault == CanaryFault::WriteAfterFree ? "write after free"
+        : "use after free";
+
+    fprintf(stderr, "canary: %s of %p (generation %u)\n", what, slot, generation);
+    abort();
+}
@@ -0,0 +1,32 @@
+#include <HeapWalk.hpp>
+
+void printMallocInfo(const HeapSummary& summary, std::ostream& out) {
+    static const char* tiers[] = { "arena", "medium", "big" };
+
+    out << "<malloc version=\"1\">\n"
+        << "<heap nr=\"0\">\n"
+        << "<sizes>\n";
+
+    for (size_t i = 0; i < summary.numBuckets; i++) {
+        const HeapSummary::Bucket& bucket = summary.buckets[i];
+
+        if (bucket.count > 0) {
+            out << "  <size from=\"" << bucket.from << "\" to=\"" << bucket.to
+                << "\" total=\"" << bucket.bytes << "\" count=\"" << bucket.count << "\"/>\n";
+        }
+    }
+
+    out << "</sizes>\n";
+
+    for (size_t tier = 0; tier < 3; tier++) {
+        out << "<total type=\"" << tiers[tier] << "\" count=\"" << summary.objects[tier]
+            << "\" size=\"" << summary.bytes[tier] << "\"/>\n";
+    }
+
+    out << "<system type=\"arenas\" count=\"" << summary.arenas << "\"/>\n"
+        << "<system type=\"medium-chunks\" count=\"" << summary.mediumChunks << "\"/>\n"
+        << "<system type=\"big-allocs\" count=\"" << summary.bigAllocs << "\"/>\n"
+        << "<system type=\"mapped\" size=\"" << summary.mappedBytes << "\"/>\n"
+        << "</heap>\n"
+        << "</malloc>\n";
+}
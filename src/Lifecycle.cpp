@@ -0,0 +1,104 @@
+#include <Lifecycle.hpp>
+#include <ThreadCache.hpp>
+#include <mutex>
+#include <pthread.h>
+
+// Guards the list below. Held across every hook call, so hooks never run
+// concurrently with each other or with (un)registration.
+static std::mutex s_hooksMutex;
+static LifecycleHooks* s_hooks = nullptr;
+
+static void prepareFork() {
+    s_hooksMutex.lock();
+
+    for (int tier = 0; tier < LifecycleHooks::numTiers; tier++) {
+        for (LifecycleHooks* hooks = s_hooks; hooks != nullptr; hooks = hooks->next) {
+            if (hooks->tier == tier) {
+                hooks->prepareFork(hooks->context);
+            }
+        }
+    }
+}
+
+static void parentFork() {
+    for (int tier = LifecycleHooks::numTiers - 1; tier >= 0; tier--) {
+        for (LifecycleHooks* hooks = s_hooks; hooks != nullptr; hooks = hooks->next) {
+            if (hooks->tier == tier) {
+                hooks->parentFork(hooks->context);
+            }
+        }
+    }
+
+    s_hooksMutex.unlock();
+}
+
+static void childFork() {
+    resetThreadIndicesAfterFork();
+
+    for (int tier = LifecycleHooks::numTiers - 1; tier >= 0; tier--) {
+        for (LifecycleHooks* hooks = s_hooks; hooks != nullptr; hooks = hooks->next) {
+            if (hooks->tier == tier) {
+                hooks->childFork(hooks->context, t_threadIndex);
+            }
+        }
+    }
+
+    s_hooksMutex.unlock();
+}
+
+void registerLifecycleHooks(LifecycleHooks* hooks) {
+    static std::once_flag atforkInstalled;
+
+    std::call_once(atforkInstalled, [] {
+        pthread_atfork(prepareFork, parentFork, childFork);
+    });
+
+    std::lock_guard<std::mutex> guard(s_hooksMutex);
+
+    if (hooks->registered.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    hooks->next = s_hooks;
+    s_hooks = hooks;
+    hooks->registered.store(true, std::memory_order_release);
+}
+
+void unregisterLifecycleHooks(LifecycleHooks* hooks) {
+    std::lock_guard<std::mutex> guard(s_hooksMutex);
+
+    if (!hooks->registered.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    for (LifecycleHooks** link = &s_hooks; *link != nullptr; link = &(*link)->next) {
+        if (*link == hooks) {
+            *link = hooks->next;
+            break;
+        }
+    }
+
+    hooks->registered.store(false, std::memory_order_relaxed);
+}
+
+void runMemoryPressureHooks() {
+    std::lock_guard<std::mutex> guard(s_hooksMutex);
+
+    for (int tier = 0; tier < LifecycleHooks::numTiers; tier++) {
+        for (LifecycleHooks* hooks = s_hooks; hooks != nullptr; hooks = hooks->next) {
+            if (hooks->tier == tier && hooks->releaseMemory != nullptr) {
+                hooks->releaseMemory(hooks->context);
+            }
+        }
+    }
+}
+
+void runThreadExitHooks(size_t index) {
+    std::lock_guard<std::mutex> guard(s_hooksMutex);
+
+    for (LifecycleHooks* hooks = s_hooks; hooks != nullptr; hooks = hooks->next) {
+        if (hooks->threadExit != nullptr) {
+            hooks->threadExit(hooks->context, index);
+        }
+    }
+}
@@ -1,37 +1,78 @@
 #include <Malloc.hpp>
 #include <sys/mman.h>
-#include <mutex>          // std::mutex
+
+static DefaultArenaStore s_store;
+
+static void checkForLeaks() {
+    s_store.trim();
+
+    std::cerr << "leak check:\n";
+    reportLiveObjects(s_store, std::cerr);
+}
+
+#ifdef ARENA_LEAK_CHECK
+static const bool s_leakCheck = (myMallocEnableLeakCheck(), true);
+#endif
+
+#ifdef ARENA_WARM_POOL
+// Prefault ARENA_WARM_POOL arenas per size class before main() runs.
+static const bool s_warmPool = s_store.warm(ARENA_WARM_POOL);
+#endif
+
+#ifdef ARENA_CGROUP_LIMITS
+// Cap the allocator below the container's memory limit from the start.
+static const bool s_cgroupLimits = MemoryLimits::fromCgroup();
+#endif
+
 /**
  * Your special drop-in replacement for malloc(). Should behave the same way.
  */
-
-std::mutex mtx; 
-
 void* myMalloc(size_t n) {
-    // TODO: implement myMalloc
-     mtx.lock();
-    ArenaStore as;
-    return as.alloc(n);
-    mtx.unlock();
+    return s_store.alloc(n);
 }
 
 /**
  * Your special drop-in replacement for free(). Should behave the same way.
  */
 void myFree(void* addr) {
-    // TODO: implement myFree
-     mtx.lock();
-    MMapObject *mmpaObj = reinterpret_cast <MMapObject *>(addr);
-    MMapObject::dealloc(mmpaObj);
-    if(mmpaObj->arenaSize() != 0)
-    {
-        Arena *arena = reinterpret_cast <Arena *>(mmpaObj);
-        arena->deallocate();
-    }
-    mtx.unlock();
+    s_store.free(addr);
+}
+
+void* myMallocAligned(size_t alignment, size_t n) {
+    return s_store.alloc(n, alignment);
+}
+
+bool myMallocValidate(void* ptr) {
+    return s_store.validate(ptr);
+}
+
+bool myMallocWarm(size_t arenasPerClass) {
+    return s_store.warm(arenasPerClass);
+}
+
+void myMallocTrim() {
+    s_store.trim();
+}
+
+const DefaultArenaStore::Stats& myMallocStats() {
+    return s_store.stats();
+}
+
+void myMallocInfo(std::ostream& out) {
+    printMallocInfo(s_store.summary(), out);
+}
+
+void myMallocEnableLeakCheck() {
+    static std::once_flag registered;
+
+    // Registered after s_store was constructed, so it runs before s_store is
+    // destroyed.
+    std::call_once(registered, [] {
+        atexit(checkForLeaks);
+    });
 }
 
 
 
 
-std::atomic<size_t> MMapObject::s_outstandingPages = 0;
\ No newline at end of file
+std::atomic<size_t> MMapObject::s_outstandingPages = 0;
@@ -0,0 +1,59 @@
+#include <MemoryLimits.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+bool MemoryLimits::fromCgroupFile(const char* path) {
+    FILE* file = fopen(path, "r");
+
+    if (file == nullptr) {
+        return false;
+    }
+
+    char text[64] = {};
+    bool read = fgets(text, sizeof(text), file) != nullptr;
+    fclose(file);
+
+    char* end = nullptr;
+    unsigned long long limit = read ? strtoull(text, &end, 10) : 0;
+
+    // "max", or anything else that isn't a number, means no limit.
+    if (end == text || limit == 0) {
+        return false;
+    }
+
+    set(limit / 4 * 3, limit / 8 * 7);
+
+    return true;
+}
+
+bool MemoryLimits::fromCgroup() {
+    FILE* file = fopen("/proc/self/cgroup", "r");
+
+    if (file == nullptr) {
+        return false;
+    }
+
+    // Under cgroup v2 the process's group is the single "0::/path" line.
+    char line[4096];
+    std::string group;
+
+    while (fgets(line, sizeof(line), file) != nullptr) {
+        if (strncmp(line, "0::", 3) == 0) {
+            group = line + 3;
+            group.erase(group.find_last_not_of('\n') + 1);
+            break;
+        }
+    }
+
+    fclose(file);
+
+    if (group.empty()) {
+        return false;
+    }
+
+    std::string path = "/sys/fs/cgroup" + (group == "/" ? std::string() : group) + "/memory.max";
+
+    return fromCgroupFile(path.c_str());
+}
@@ -0,0 +1,121 @@
+#include <SharedArena.hpp>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+SharedRegion::SharedRegion(SharedRegion&& other)
+    : m_base(std::exchange(other.m_base, nullptr)),
+      m_size(std::exchange(other.m_size, 0)),
+      m_fd(std::exchange(other.m_fd, -1)) { }
+
+SharedRegion& SharedRegion::operator=(SharedRegion&& other) {
+    if (this != &other) {
+        this->~SharedRegion();
+        m_base = std::exchange(other.m_base, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+        m_fd = std::exchange(other.m_fd, -1);
+    }
+
+    return *this;
+}
+
+SharedRegion::~SharedRegion() {
+    if (m_base != nullptr) {
+        munmap(m_base, m_size);
+    }
+
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+SharedRegion SharedRegion::anonymous(const char* name, size_t size) {
+    int fd = memfd_create(name, MFD_CLOEXEC);
+
+    if (fd < 0) {
+        return SharedRegion();
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        close(fd);
+        return SharedRegion();
+    }
+
+    return mapOwned(fd, size);
+}
+
+SharedRegion SharedRegion::named(const char* name, size_t size, bool create) {
+    int fd = shm_open(name, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+
+    if (fd < 0) {
+        return SharedRegion();
+    }
+
+    if (create && ftruncate(fd, size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return SharedRegion();
+    }
+
+    if (!create) {
+        struct stat st;
+
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return SharedRegion();
+        }
+
+        size = st.st_size;
+    }
+
+    return mapOwned(fd, size);
+}
+
+SharedRegion SharedRegion::fromFd(int fd) {
+    struct stat st;
+
+    if (fstat(fd, &st) != 0) {
+        return SharedRegion();
+    }
+
+    int copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+    if (copy < 0) {
+        return SharedRegion();
+    }
+
+    return mapOwned(copy, st.st_size);
+}
+
+SharedRegion SharedRegion::file(const char* path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+
+    if (fd < 0) {
+        return SharedRegion();
+    }
+
+    if (fstat(fd, &st) != 0 || (st.st_size == 0 && ftruncate(fd, size) != 0)) {
+        close(fd);
+        return SharedRegion();
+    }
+
+    return mapOwned(fd, st.st_size == 0 ? size : st.st_size);
+}
+
+bool SharedRegion::unlink(const char* name) {
+    return shm_unlink(name) == 0;
+}
+
+SharedRegion SharedRegion::mapOwned(int fd, size_t size) {
+    void* base = size == 0 ? MAP_FAILED : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (base == MAP_FAILED) {
+        close(fd);
+        return SharedRegion();
+    }
+
+    return SharedRegion(static_cast<char*>(base), size, fd);
+}
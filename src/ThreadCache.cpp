@@ -0,0 +1,65 @@
+#include <ThreadCache.hpp>
+#include <Lifecycle.hpp>
+
+// One bit per thread index; set while a live thread holds it.
+static std::atomic<uint64_t> s_usedIndices[maxThreadIndices / 64];
+
+/**
+ * When the thread exits, has every store return what the thread has cached,
+ * then gives its index back.
+ */
+class ThreadIndexReleaser {
+public:
+    ~ThreadIndexReleaser() {
+        size_t index = t_threadIndex;
+
+        // Anything the thread frees from here on, e.g. in later thread_local
+        // destructors, takes the uncached path.
+        t_threadIndex = noThreadIndex;
+
+        if (index < maxThreadIndices) {
+            runThreadExitHooks(index);
+
+            s_usedIndices[index / 64].fetch_and(
+                ~(uint64_t(1) << (index % 64)), std::memory_order_release
+            );
+        }
+    }
+};
+
+size_t acquireThreadIndex() {
+    for (size_t word = 0; word < maxThreadIndices / 64; word++) {
+        uint64_t used = s_usedIndices[word].load(std::memory_order_relaxed);
+
+        while (~used != 0) {
+            size_t bit = __builtin_ctzll(~used);
+
+            if (s_usedIndices[word].compare_exchange_weak(
+                used, used | (uint64_t(1) << bit), std::memory_order_acquire, std::memory_order_relaxed
+            )) {
+                static thread_local ThreadIndexReleaser releaser;
+                (void)releaser;
+
+                t_threadIndex = word * 64 + bit;
+
+                return t_threadIndex;
+            }
+        }
+    }
+
+    t_threadIndex = noThreadIndex;
+
+    return noThreadIndex;
+}
+
+void resetThreadIndicesAfterFork() {
+    size_t survivor = t_threadIndex;
+
+    for (size_t word = 0; word < maxThreadIndices / 64; word++) {
+        uint64_t keep = survivor < maxThreadIndices && survivor / 64 == word
+            ? uint64_t(1) << (survivor % 64)
+            : 0;
+
+        s_usedIndices[word].store(keep, std::memory_order_relaxed);
+    }
+}
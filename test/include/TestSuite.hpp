@@ -23,7 +23,12 @@ class TestSuite {
 private:
     std::vector<Test> m_tests;
 
+    // Only tests whose name contains this are run. Empty runs everything.
+    static std::string s_filter;
+
 public:
     uint64_t run();
     void add(const Test& test);
+
+    static void setFilter(const std::string& filter);
 };
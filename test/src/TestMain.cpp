@@ -3,7 +3,11 @@
 
 int testMain(int argc, const char* argv[]) {
     int fail = 0;
-    
+
+    if (argc > 1) {
+        TestSuite::setFilter(argv[1]);
+    }
+
     fail += runMallocTests();
 
     return fail;
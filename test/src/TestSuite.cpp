@@ -11,10 +11,16 @@ const std::string& Test::name() const { return m_name; }
 
 void Test::run() const { m_test(); }
 
+std::string TestSuite::s_filter;
+
 uint64_t TestSuite::run() {
     uint64_t failures = 0;
 
     for (auto test : m_tests) {
+        if (test.name().find(s_filter) == std::string::npos) {
+            continue;
+        }
+
         try {
             test.run();
 
@@ -32,4 +38,8 @@ uint64_t TestSuite::run() {
 
 void TestSuite::add(const Test& test) {
     m_tests.push_back(test);
+}
+
+void TestSuite::setFilter(const std::string& filter) {
+    s_filter = filter;
 }
\ No newline at end of file